@@ -1,6 +1,7 @@
 #include "Assignment10.hh"
 
 // System headers
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <vector>
@@ -18,6 +19,7 @@
 #include <glow/objects/ArrayBuffer.hh>
 #include <glow/objects/ElementArrayBuffer.hh>
 #include <glow/objects/Framebuffer.hh>
+#include <glow/objects/OcclusionQuery.hh>
 #include <glow/objects/Program.hh>
 #include <glow/objects/Texture2D.hh>
 #include <glow/objects/Texture2DArray.hh>
@@ -40,6 +42,7 @@
 // GLFW
 #include <GLFW/glfw3.h>
 
+#include "Benchmarks.hh"
 #include "FrustumCuller.hh"
 
 // in the implementation, we want to omit the glow:: prefix
@@ -102,9 +105,17 @@ void Assignment10::update(float elapsedSeconds)
 
     mRuntime += elapsedSeconds;
 
-    // generate chunks that might be visible
+    // meshing options
+    mWorld.setGreedyMeshing(mGreedyMeshing);
+
+    // generate chunks that might be visible (visible ones first)
+    mWorld.notifyCameraFrustum(std::make_shared<FrustumCuller>(*getCamera(), false));
     mWorld.notifyCameraPosition(getCamera()->getPosition(), mRenderDistance);
 
+    // level of detail by screen-space error
+    for (auto const& kvp : mWorld.chunks)
+        mWorld.requestLod(kvp.second, mEnableLod ? selectLod(*kvp.second) : 0);
+
     // update terrain
     mWorld.update(elapsedSeconds);
 
@@ -141,6 +152,11 @@ void Assignment10::render(float elapsedSeconds)
 
     // update stats
     mStatsChunksGenerated = mWorld.chunks.size();
+    mStatsBlockMemoryMB = mWorld.residentBlockBytes() / (1024.0f * 1024.0f);
+    mStatsMeshMemoryMB = mWorld.residentMeshBytes() / (1024.0f * 1024.0f);
+    mStatsMeshUploadKB = mWorld.meshBuffers.uploadedBytes() / 1024.0f;
+    mStatsOccluders = 0;
+    mStatsShadowCascadesRendered = 0;
     for (auto i = 0; i < 4; ++i)
     {
         mStatsMeshesRendered[i] = 0;
@@ -162,6 +178,14 @@ void Assignment10::render(float elapsedSeconds)
     // renormalize light dir (tweakbar might have changed it)
     mLightDir = normalize(mLightDir);
 
+    // software occlusion (before any render jobs are collected)
+    if (mEnableSoftwareOcclusion)
+        updateSoftwareOcclusion(getCamera().get());
+
+    // render jobs of all passes
+    updateShadowCascades();
+    cullScene();
+
     // rendering pipeline
     {
         // Shadow Pass
@@ -193,18 +217,50 @@ void Assignment10::render(float elapsedSeconds)
         renderOutputStage();
     }
 
+    // drop mesh changes that all render job caches and shadow cascades have seen
+    auto oldestGeneration = mShadowMeshGeneration;
+    for (auto const& kvp : mRenderJobCaches)
+        if (kvp.second.meshGeneration >= 0)
+            oldestGeneration = glm::min(oldestGeneration, kvp.second.meshGeneration);
+    mWorld.trimMeshLog(oldestGeneration);
+
     // update stats
     for (auto i = 0; i < 4; ++i)
         mStatsVerticesPerMesh[i] = mStatsVerticesRendered[i] == 0 ? -1 : //
                                        mStatsVerticesRendered[i] / (float)mStatsMeshesRendered[i];
 }
 
-void Assignment10::renderShadowPass()
+void Assignment10::updateShadowCascades()
 {
     // ensure that sizes are correct
     updateShadowMapTexture();
 
     auto cam = getCamera();
+    auto camPos = cam->getPosition();
+    auto cInvView = inverse(cam->getViewMatrix());
+    auto cInvProj = inverse(cam->getProjectionMatrix());
+    auto camDir = normalize(glm::vec3(cInvView * glm::vec4(0, 0, -1, 0)));
+
+    auto sView = lookAt(mLightDir, glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
+
+    // frustum edges (view space, scaled to depth 1) and the cosine of their angle to the view axis
+    glm::vec3 edgeDirs[4];
+    auto cosEdge = 1.0f;
+    for (auto i = 0; i < 4; ++i)
+    {
+        auto viewPos = cInvProj * glm::vec4(i & 1 ? 1 : -1, i & 2 ? 1 : -1, 1, 1);
+        auto dir = glm::vec3(viewPos) / viewPos.w;
+        edgeDirs[i] = dir / -dir.z;
+        cosEdge = glm::min(cosEdge, 1.0f / length(edgeDirs[i]));
+    }
+
+    // chunks whose meshes changed since the last frame
+    auto& changed = mShadowChangedChunks;
+    changed.clear();
+    auto changesKnown = mShadowMeshGeneration >= 0 && mWorld.meshChangesSince(mShadowMeshGeneration, changed);
+    auto meshesChanged = mShadowMeshGeneration != mWorld.meshGeneration();
+    mShadowMeshGeneration = mWorld.meshGeneration();
+
     for (auto cascIdx = 0; cascIdx < SHADOW_CASCADES; ++cascIdx)
     {
         auto& cascade = mShadowCascades[cascIdx];
@@ -213,41 +269,25 @@ void Assignment10::renderShadowPass()
         cascade.minRange = mRenderDistance * (cascIdx + 0.0f) / SHADOW_CASCADES;
         cascade.maxRange = mRenderDistance * (cascIdx + 1.0f) / SHADOW_CASCADES;
 
-        auto cInvView = inverse(cam->getViewMatrix());
-        auto cInvProj = inverse(cam->getProjectionMatrix());
-
-        auto sView = lookAt(mLightDir, glm::vec3(0, 0, 0), glm::vec3(0, 1, 0));
-
-        auto sMin = glm::vec3(std::numeric_limits<float>::max());
-        auto sMax = -sMin;
-
-        // calculate shadow frustum
-        auto const res = 8;
-        for (auto nz : {-1, 1})
-            for (auto iy = 0; iy < res; ++iy)
-                for (auto ix = 0; ix < res; ++ix)
-                {
-                    auto ny = iy / (res - 1.0f) * 2 - 1;
-                    auto nx = ix / (res - 1.0f) * 2 - 1;
-
-                    auto ndc = glm::vec4(nx, ny, nz, 1.0f);
-                    auto viewPos = cInvProj * ndc;
-                    viewPos /= viewPos.w;
-                    auto worldPos = glm::vec3(cInvView * viewPos);
-
-                    auto dir = glm::vec3(worldPos - cam->getPosition());
-                    auto dis = length(dir);
-                    worldPos = cam->getPosition() + dir * (glm::clamp(dis, cascade.minRange, cascade.maxRange) / dis);
-
-                    auto shadowViewPos = glm::vec3(sView * glm::vec4(worldPos, 1.0));
-
-                    sMin = min(sMin, shadowViewPos);
-                    sMax = max(sMax, shadowViewPos);
-                }
-
-        // elongate shadow aabb
-        sMin -= 1.0f;
-        sMax += 1.0f;
+        // bounding sphere of the part, centered on the view axis
+        // (the farthest points are on the frustum edges, so the radius does not depend on the camera orientation)
+        auto rMin = cascade.minRange;
+        auto rMax = cascade.maxRange;
+        auto centerDis = glm::min((rMin + rMax) / (2 * cosEdge), rMax);
+        auto radius = 0.0f;
+        for (auto r : {rMin, rMax})
+            radius = glm::max(radius, glm::sqrt(glm::max(0.0f, r * r + centerDis * centerDis - 2 * r * centerDis * cosEdge)));
+        radius = glm::ceil(radius + 1.0f);
+
+        // snap the center to whole texels in light space
+        // (moving the camera then shifts the shadow map by whole texels, so shadow edges do not shimmer)
+        auto texelSize = 2 * radius / mShadowMapSize;
+        auto center = glm::vec3(sView * glm::vec4(camPos + camDir * centerDis, 1.0));
+        center = glm::floor(center / texelSize) * texelSize;
+
+        // shadow aabb, elongated towards the light
+        auto sMin = center - radius;
+        auto sMax = center + radius;
         sMax.z = sMin.z + glm::max(mShadowRange, sMax.z - sMin.z);
 
         // min..max -> 0..1 -> -1..1
@@ -256,8 +296,6 @@ void Assignment10::renderShadowPass()
                      scale(1.0f / (sMax - sMin) * 2.0) * //
                      translate(-sMin);
 
-        // TODO: stabilize min/max
-
         // set up shadow camera
         cascade.camera.setPosition(mLightDir);
         cascade.camera.setViewMatrix(sView);
@@ -265,6 +303,54 @@ void Assignment10::renderShadowPass()
         cascade.camera.setViewportSize({mShadowMapSize, mShadowMapSize});
         mShadowViewProjs[cascIdx] = cascade.camera.getProjectionMatrix() * cascade.camera.getViewMatrix();
 
+        // covered part of the camera frustum with planar near and far sides
+        // (conservative: the near side is at the smallest depth of a point at distance minRange)
+        auto nearDepth = glm::max(cam->getNearClippingPlane(), rMin * cosEdge);
+        for (auto i = 0; i < 8; ++i)
+            cascade.sliceCorners[i] = glm::vec3(cInvView * glm::vec4(edgeDirs[i & 3] * (i & 4 ? rMax : nearDepth), 1.0f));
+        cascade.casterMargin = 1.0f + 4 * texelSize;
+
+        // re-render if bounds or settings changed ..
+        if (mShadowViewProjs[cascIdx] != cascade.renderedViewProj || mShadowExponent != cascade.renderedExponent
+            || mEnableShadows != cascade.renderedShadows || mSoftShadows != cascade.renderedSoftShadows)
+            cascade.needsRender = true;
+
+        // .. or meshes within the cascade changed
+        if (!cascade.needsRender && mEnableShadows && meshesChanged)
+        {
+            if (!changesKnown)
+                cascade.needsRender = true;
+            else
+            {
+                FrustumCuller culler(cascade.camera, true);
+                for (auto p : changed)
+                    if (culler.isAabbVisible(glm::vec3(p), glm::vec3(p + CHUNK_SIZE)))
+                    {
+                        cascade.needsRender = true;
+                        break;
+                    }
+            }
+        }
+    }
+}
+
+void Assignment10::renderShadowPass()
+{
+    for (auto cascIdx = 0; cascIdx < SHADOW_CASCADES; ++cascIdx)
+    {
+        auto& cascade = mShadowCascades[cascIdx];
+
+        // shadow map is still up-to-date (see updateShadowCascades)
+        if (!cascade.needsRender)
+            continue;
+
+        cascade.needsRender = false;
+        cascade.renderedViewProj = mShadowViewProjs[cascIdx];
+        cascade.renderedExponent = mShadowExponent;
+        cascade.renderedShadows = mEnableShadows;
+        cascade.renderedSoftShadows = mSoftShadows;
+        ++mStatsShadowCascadesRendered;
+
         // render shadowmap
         {
             auto fb = cascade.framebuffer->bind();
@@ -325,7 +411,117 @@ void Assignment10::renderDepthPrePass()
 
     // render scene depth-pre
     if (mPassDepthPre)
+    {
         renderScene(getCamera().get(), RenderPass::DepthPre);
+
+        // test occluded and visible chunks against the depth of the visible ones
+        if (mEnableOcclusionCulling)
+            issueOcclusionQueries(getCamera().get());
+    }
+}
+
+void Assignment10::updateOcclusionResults()
+{
+    for (auto const& chunkPair : mWorld.chunks)
+    {
+        auto& o = chunkPair.second->occlusion();
+
+        // read results without waiting
+        if (o.pending && o.query->isResultAvailable())
+        {
+            o.visible = o.query->getResult() > 0;
+            o.pending = false;
+        }
+
+        // chunks that were not tested in the last frame are visible again
+        // (e.g. when turning back to them)
+        if (o.testFrame != mOcclusionFrame)
+            o.visible = true;
+    }
+}
+
+void Assignment10::issueOcclusionQueries(camera::CameraBase* cam)
+{
+    GLOW_SCOPED(depthMask, GL_FALSE);
+    GLOW_SCOPED(disable, GL_CULL_FACE); // boxes are closed, back faces never pass before front faces
+
+    setUpShader(mShaderOcclusionBox.get(), cam, RenderPass::DepthPre);
+    auto shader = mShaderOcclusionBox->use();
+    auto vao = mMeshCube->bind();
+
+    auto camPos = cam->getPosition();
+    auto margin = cam->getNearClippingPlane() + 1.0f;
+    for (auto chunk : mOcclusionTests)
+    {
+        auto& o = chunk->occlusion();
+        if (o.pending)
+            continue; // previous result still in flight
+
+        // the near plane might clip the box
+        auto aabbMin = chunk->getAabbMin();
+        auto aabbMax = chunk->getAabbMax();
+        if (all(greaterThanEqual(camPos, aabbMin - margin)) && all(lessThanEqual(camPos, aabbMax + margin)))
+        {
+            o.visible = true;
+            continue;
+        }
+
+        if (!o.query)
+            o.query = OcclusionQuery::create();
+
+        // slightly enlarged (the box must not be hidden by the geometry it contains)
+        shader.setUniform("uBoxMin", aabbMin - 0.01f);
+        shader.setUniform("uBoxMax", aabbMax + 0.01f);
+
+        o.query->begin();
+        vao.draw();
+        o.query->end();
+        o.pending = true;
+    }
+}
+
+void Assignment10::updateSoftwareOcclusion(camera::CameraBase* cam)
+{
+    ++mSoftwareOcclusionFrame;
+
+    // fully solid chunks in the frustum and within the render distance
+    FrustumCuller culler(*cam, false);
+    auto camPos = cam->getPosition();
+    mOccluderCandidates.clear();
+    for (auto const& chunkPair : mWorld.chunks)
+    {
+        auto const& chunk = *chunkPair.second;
+        if (!chunk.isGenerated() || chunk.isCpuDirty() || !chunk.isFullySolid())
+            continue;
+
+        auto amin = chunk.getAabbMin();
+        auto amax = chunk.getAabbMax();
+        if (mEnableFrustumCulling && !culler.isAabbVisible(amin, amax))
+            continue;
+        if (!culler.isAabbInRange(amin, amax, mRenderDistance))
+            continue;
+
+        mOccluderCandidates.push_back({distance(camPos, clamp(camPos, amin, amax)), &chunk});
+    }
+
+    // .. the nearest ones cover the most pixels
+    auto count = std::min((int)mOccluderCandidates.size(), std::max(0, mMaxOccluders));
+    std::nth_element(mOccluderCandidates.begin(), mOccluderCandidates.begin() + count, mOccluderCandidates.end(),
+                     [](std::pair<float, Chunk const*> const& a, std::pair<float, Chunk const*> const& b) {
+                         return a.first < b.first;
+                     });
+
+    mSoftwareOcclusion.begin(cam->getProjectionMatrix() * cam->getViewMatrix(), camPos);
+    for (auto i = 0; i < count; ++i)
+    {
+        auto chunk = mOccluderCandidates[i].second;
+        mSoftwareOcclusion.addOccluder(chunk->getAabbMin(), chunk->getAabbMax());
+    }
+
+    // .. rasterize (one task per tile)
+    mTaskPool.parallelFor(SoftwareOcclusion::tileCount, [&](int tile) { mSoftwareOcclusion.rasterizeTile(tile); });
+
+    mStatsOccluders = mSoftwareOcclusion.occluderCount();
 }
 
 void Assignment10::renderOpaquePass()
@@ -601,133 +797,346 @@ void Assignment10::renderOutputStage()
     mMeshQuad->bind().draw();
 }
 
-void Assignment10::renderScene(camera::CameraBase* cam, RenderPass pass)
+bool Assignment10::isRenderedBefore(TerrainJob const& a, TerrainJob const& b)
 {
-    // set up general purpose shaders
-    switch (pass)
+    if (a.program != b.program)
+        return a.program < b.program;
+    if (a.mat != b.mat)
+        return a.mat < b.mat;
+    if (a.mesh != b.mesh)
+        return a.mesh < b.mesh;
+    return a.camDis < b.camDis;
+}
+
+void Assignment10::cullScene()
+{
+    auto cam = getCamera().get();
+
+    // results of earlier hardware occlusion queries
+    if (mPassDepthPre)
     {
-    case RenderPass::Opaque:
-        setUpShader(mShaderPlants.get(), cam, pass);
-        break;
-    case RenderPass::Transparent:
-        setUpShader(mShaderLineTransparent.get(), cam, pass);
-        setUpShader(mShaderLightSprites.get(), cam, pass);
-        break;
-    default:
-        break;
+        updateOcclusionResults();
+
+        ++mOcclusionFrame;
+        mOcclusionTests.clear();
     }
 
-    // render terrain
+    // views of this frame
+    mCullViews.clear();
+    if (mEnableShadows)
+        for (auto& cascade : mShadowCascades)
+            if (cascade.needsRender)
+                mCullViews.push_back({&cascade.camera, RenderPass::Shadow, &cascade, nullptr});
+    if (mPassDepthPre)
+        mCullViews.push_back({cam, RenderPass::DepthPre, nullptr, nullptr});
+    if (mPassOpaque)
+        mCullViews.push_back({cam, RenderPass::Opaque, nullptr, nullptr});
+    if (mPassTransparent)
+        mCullViews.push_back({cam, RenderPass::Transparent, nullptr, nullptr});
+    for (auto& v : mCullViews)
     {
-        FrustumCuller culler(*cam, pass == RenderPass::Shadow);
+        v.cache = &mRenderJobCaches[{v.pass, v.cam}]; // (inserts on this thread only)
+
+        // shadow casters only matter if they can shadow the part of the camera frustum of their cascade
+        v.cache->culler.reset(new FrustumCuller(*v.cam, v.pass == RenderPass::Shadow));
+        if (v.cascade)
+            v.cache->culler->addCasterVolume(v.cascade->sliceCorners, normalize(mLightDir), v.cascade->casterMargin);
+    }
 
-        struct TerrainJob
+    // .. update candidates and cull hierarchically (one task per view)
+    mTaskPool.parallelFor((int)mCullViews.size(), [&](int i) {
+        auto const& v = mCullViews[i];
+        updateRenderCandidates(*v.cache, v.cam, v.pass);
+    });
+
+    // .. collect render jobs (one task per block of visible candidates of a view)
+    auto const blockSize = 256;
+    mCullTasks.clear();
+    for (auto i = 0u; i < mCullViews.size(); ++i)
+    {
+        auto& cache = *mCullViews[i].cache;
+        auto count = (int)cache.visible.size();
+        cache.blockCount = (count + blockSize - 1) / blockSize;
+        if ((int)cache.blocks.size() < cache.blockCount)
+            cache.blocks.resize(cache.blockCount);
+
+        for (auto b = 0; b < cache.blockCount; ++b)
         {
-            Program* program;
-            RenderMaterial const* mat;
-            VertexArray* mesh;
-            float camDis;
-        };
-        struct PlantJob
+            cache.blocks[b].begin = b * blockSize;
+            cache.blocks[b].end = std::min(count, (b + 1) * blockSize);
+            mCullTasks.push_back({i, b});
+        }
+    }
+    mTaskPool.parallelFor((int)mCullTasks.size(), [&](int i) {
+        auto const& v = mCullViews[mCullTasks[i].first];
+        collectRenderJobs(*v.cache, v.cam, v.pass, v.cache->blocks[mCullTasks[i].second]);
+    });
+
+    // .. merge blocks (in order, jobs stay in render order)
+    for (auto const& v : mCullViews)
+    {
+        auto& cache = *v.cache;
+        cache.jobsTerrain.clear();
+        cache.jobsPlants.clear();
+        for (auto b = 0; b < cache.blockCount; ++b)
         {
-            VertexArray* mesh;
-            float camDis;
-        };
+            auto const& block = cache.blocks[b];
+            cache.jobsTerrain.insert(cache.jobsTerrain.end(), block.jobsTerrain.begin(), block.jobsTerrain.end());
+            cache.jobsPlants.insert(cache.jobsPlants.end(), block.jobsPlants.begin(), block.jobsPlants.end());
+
+            // every chunk in the frustum is tested once (see issueOcclusionQueries)
+            for (auto chunk : block.occlusionTests)
+                if (chunk->occlusion().testFrame != mOcclusionFrame)
+                {
+                    chunk->occlusion().testFrame = mOcclusionFrame;
+                    mOcclusionTests.push_back(chunk);
+                }
+        }
+    }
+}
 
-        // render jobs
-        std::vector<TerrainJob> jobsTerrain;
-        std::vector<PlantJob> jobsPlants;
+void Assignment10::updateRenderCandidates(RenderJobCache& cache, camera::CameraBase* cam, RenderPass pass)
+{
+    auto camPos = cam->getPosition();
+    auto& candidates = cache.candidates;
+    auto candidateOrder = [](RenderCandidate const& a, RenderCandidate const& b) { return isRenderedBefore(a.job, b.job); };
+
+    // appends the meshes of a chunk that are rendered in this pass
+    auto addCandidates = [&](Chunk& chunk) {
+        // occlusion from the main camera does not apply to shadow casters
+        auto occluded = pass != RenderPass::Shadow ? &chunk : nullptr;
 
-        // collect meshes per material and shader
+        for (auto const& mesh : chunk.queryMeshes())
         {
-            for (auto const& chunkPair : mWorld.chunks)
+            // check correct render pass
+            auto mat = mesh.mat.get();
+            if (!mat->opaque && pass != RenderPass::Transparent)
+                continue;
+            if (mat->opaque && (pass != RenderPass::Opaque && pass != RenderPass::Shadow && pass != RenderPass::DepthPre))
+                continue;
+
+            // create a render job for every material/mesh pair
+            Program* shader = nullptr;
+            VertexArray* vao = nullptr;
+            auto const& arena = *mesh.vertices->arena;
+            switch (pass)
+            {
+            case RenderPass::Shadow:
+                vao = arena.vaoPosOnly.get();
+                shader = mShaderTerrainShadow.get();
+                break;
+
+            case RenderPass::DepthPre:
+                vao = arena.vaoPosOnly.get();
+                shader = mShaderTerrainDepthPre.get();
+                break;
+
+            case RenderPass::Transparent:
+            case RenderPass::Opaque:
             {
-                auto const& chunk = chunkPair.second;
+                vao = arena.vaoFull.get();
 
-                // early out
-                if (chunk->isFullyAir())
-                    continue; // CAUTION: fully solid is wrong here -> top layer may have faces!
+                // runs on pool threads: find only (shaders are created together with their materials)
+                auto it = mShadersTerrain.find(mat->shader);
+                assert(it != mShadersTerrain.end() && "material shader not loaded (see createTerrainShader)");
+                shader = it->second.get();
+            }
+            break;
 
-                // view-frustum culling
-                if (mEnableFrustumCulling && !culler.isAabbVisible(chunk->getAabbMin(), chunk->getAabbMax()))
-                    continue; // skip culled chunks
+            default:
+                assert(0 && "not supported");
+                break;
+            }
 
-                // render distance
-                if (pass != RenderPass::Shadow && !culler.isAabbInRange(chunk->getAabbMin(), chunk->getAabbMax(), mRenderDistance))
-                    continue; // not in range
+            RenderCandidate c;
+            c.job = {shader, mat, vao, mesh.vertices->baseVertex(), mesh.indexCount, glm::vec3(chunk.chunkPos),
+                     distance(camPos, (mesh.aabbMin + mesh.aabbMax) / 2.0f)};
+            c.chunkPos = chunk.chunkPos;
+            c.dir = mesh.dir;
+            c.aabbMin = mesh.aabbMin;
+            c.aabbMax = mesh.aabbMax;
+            c.plants = pass == RenderPass::Opaque && !mesh.plants.empty() ? mesh.vaoPlants.get() : nullptr;
+            c.occluded = occluded;
+            candidates.push_back(c);
+        }
+    };
 
-                for (auto const& mesh : chunk->queryMeshes())
-                {
-                    // check correct render pass
-                    auto mat = mesh.mat.get();
-                    if (!mat->opaque && pass != RenderPass::Transparent)
-                        continue;
-                    if (mat->opaque && (pass != RenderPass::Opaque && pass != RenderPass::Shadow && pass != RenderPass::DepthPre))
-                        continue;
-
-                    // view-frustum culling (pt. 2)
-                    if (mEnableFrustumCulling && !culler.isAabbVisible(mesh.aabbMin, mesh.aabbMax))
-                        continue; // skip culled meshes
-
-                    // render distance
-                    if (pass != RenderPass::Shadow && !culler.isAabbInRange(mesh.aabbMin, mesh.aabbMax, mRenderDistance))
-                        continue; // not in range
-
-                    auto camDis = distance(cam->getPosition(), (mesh.aabbMin + mesh.aabbMax) / 2.0);
-
-                    // Vegetation (BEFORE custom BFC)
-                    if (pass == RenderPass::Opaque && mesh.abPlants->getElementCount() > 0)
-                        jobsPlants.push_back({mesh.vaoPlants.get(), camDis});
-
-                    // custom BFC
-                    if (mEnableCustomBFC && mat->opaque && !culler.isFaceVisible(mesh.dir, mesh.aabbMin, mesh.aabbMax))
-                        continue;
-
-                    // create a render job for every material/mesh pair
-                    Program* shader = nullptr;
-                    VertexArray* vao = nullptr;
-                    switch (pass)
-                    {
-                    case RenderPass::Shadow:
-                        vao = mesh.vaoPosOnly.get();
-                        shader = mShaderTerrainShadow.get();
-                        break;
+    // apply mesh changes
+    if (cache.meshGeneration != mWorld.meshGeneration())
+    {
+        auto& changed = cache.changedChunks;
+        changed.clear();
+        if (cache.meshGeneration >= 0 && mWorld.meshChangesSince(cache.meshGeneration, changed))
+        {
+            auto posLess = [](glm::ivec3 a, glm::ivec3 b) {
+                return a.x != b.x ? a.x < b.x : a.y != b.y ? a.y < b.y : a.z < b.z;
+            };
+            std::sort(changed.begin(), changed.end(), posLess);
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+            // .. drop old meshes of changed chunks (keeps the order)
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                            [&](RenderCandidate const& c) {
+                                                return std::binary_search(changed.begin(), changed.end(), c.chunkPos, posLess);
+                                            }),
+                             candidates.end());
+
+            // .. merge in their new meshes
+            auto oldCount = candidates.size();
+            for (auto p : changed)
+                if (auto chunk = mWorld.chunks.get(p)) // (queryChunk is main thread only)
+                    addCandidates(*chunk);
+            std::sort(candidates.begin() + oldCount, candidates.end(), candidateOrder);
+            std::inplace_merge(candidates.begin(), candidates.begin() + oldCount, candidates.end(), candidateOrder);
+        }
+        else
+        {
+            // .. rebuild from scratch
+            candidates.clear();
+            for (auto const& chunkPair : mWorld.chunks)
+                addCandidates(*chunkPair.second);
+            std::sort(candidates.begin(), candidates.end(), candidateOrder);
+        }
 
-                    case RenderPass::DepthPre:
-                        vao = mesh.vaoPosOnly.get();
-                        shader = mShaderTerrainDepthPre.get();
-                        break;
+        cache.meshGeneration = mWorld.meshGeneration();
 
-                    case RenderPass::Transparent:
-                    case RenderPass::Opaque:
-                        vao = mesh.vaoFull.get();
-                        shader = mShadersTerrain[mat->shader].get();
-                        break;
+        // .. rebuild culling tree
+        cache.treeItems.clear();
+        cache.positions.resize(candidates.size());
+        for (auto i = 0u; i < candidates.size(); ++i)
+        {
+            auto& c = candidates[i];
+            c.id = i;
+            cache.positions[i] = i;
+            cache.treeItems.push_back({c.aabbMin, c.aabbMax, c.id});
+        }
+        cache.tree.build(cache.treeItems);
+    }
 
-                    default:
-                        assert(0 && "not supported");
-                        break;
-                    }
+    // re-sort front-to-back when the camera enters another cell
+    // (order barely changes, insertion sort is linear for nearly sorted data)
+    auto cell = glm::ivec3(glm::floor(camPos / float(CHUNK_SIZE)));
+    if (!cache.hasSortCell || cell != cache.sortCell)
+    {
+        for (auto& c : candidates)
+            c.job.camDis = distance(camPos, (c.aabbMin + c.aabbMax) / 2.0f);
 
-                    // add render job
-                    jobsTerrain.push_back({shader, mat, vao, camDis});
-                }
+        for (auto i = 1u; i < candidates.size(); ++i)
+        {
+            auto c = candidates[i];
+            auto j = i;
+            for (; j > 0 && candidateOrder(c, candidates[j - 1]); --j)
+                candidates[j] = candidates[j - 1];
+            candidates[j] = c;
+        }
+
+        for (auto i = 0u; i < candidates.size(); ++i)
+            cache.positions[candidates[i].id] = i;
+
+        cache.sortCell = cell;
+        cache.hasSortCell = true;
+    }
+
+    // hierarchical view-frustum and render distance culling
+    // (visible candidates are brought back into render order)
+    auto& visible = cache.visible;
+    visible.clear();
+    cache.tree.query(*cache.culler, mEnableFrustumCulling, pass != RenderPass::Shadow ? mRenderDistance : -1.0f,
+                     [&](int id) { visible.push_back(cache.positions[id]); });
+    std::sort(visible.begin(), visible.end());
+}
+
+void Assignment10::collectRenderJobs(RenderJobCache const& cache, camera::CameraBase* cam, RenderPass pass, CullBlock& block) const
+{
+    auto const& culler = *cache.culler;
+
+    // collect visible jobs
+    auto useOcclusion = mEnableOcclusionCulling && mPassDepthPre && pass != RenderPass::Shadow;
+    auto useSoftwareOcclusion = mEnableSoftwareOcclusion && pass != RenderPass::Shadow && cam == getCamera().get();
+    block.jobsTerrain.clear();
+    block.jobsPlants.clear();
+    block.occlusionTests.clear();
+    for (auto i = block.begin; i < block.end; ++i)
+    {
+        auto const& c = cache.candidates[cache.visible[i]];
+
+        // software occlusion culling (once per chunk and frame)
+        // (slightly enlarged, fully solid chunks must not hide themselves)
+        if (useSoftwareOcclusion && c.occluded)
+        {
+            auto& o = c.occluded->occlusion();
+            if (o.softwareFrame.load(std::memory_order_acquire) != mSoftwareOcclusionFrame)
+            {
+                auto occluded = mSoftwareOcclusion.isOccluded(c.occluded->getAabbMin() - 0.01f, c.occluded->getAabbMax() + 0.01f);
+                o.softwareOccluded.store(occluded, std::memory_order_relaxed);
+                o.softwareFrame.store(mSoftwareOcclusionFrame, std::memory_order_release);
             }
+
+            if (o.softwareOccluded.load(std::memory_order_relaxed))
+                continue;
         }
 
-        // .. sort renderjobs
+        // occlusion culling (results of an earlier frame)
+        // (the depth pre-pass schedules all chunks in the frustum for testing)
+        if (useOcclusion && c.occluded)
+        {
+            if (pass == RenderPass::DepthPre)
+                block.occlusionTests.push_back(c.occluded);
+
+            if (!c.occluded->occlusion().visible)
+                continue;
+        }
+
+        // Vegetation (BEFORE custom BFC)
+        if (c.plants)
+            block.jobsPlants.push_back({c.plants, c.job.camDis});
+
+        // custom BFC
+        if (mEnableCustomBFC && c.job.mat->opaque && !culler.isFaceVisible(c.dir, c.aabbMin, c.aabbMax))
+            continue;
+
+        block.jobsTerrain.push_back(c.job);
+    }
+}
+
+void Assignment10::renderScene(camera::CameraBase* cam, RenderPass pass)
+{
+    // set up general purpose shaders
+    switch (pass)
+    {
+    case RenderPass::Opaque:
+        setUpShader(mShaderPlants.get(), cam, pass);
+        break;
+    case RenderPass::Transparent:
+        setUpShader(mShaderLineTransparent.get(), cam, pass);
+        setUpShader(mShaderLightSprites.get(), cam, pass);
+        break;
+    default:
+        break;
+    }
+
+    // render terrain
+    {
+        // visible meshes (collected in cullScene, already in render order)
+        auto& cache = mRenderJobCaches[{pass, cam}];
+        auto const& jobsTerrain = cache.jobsTerrain;
+        auto const& jobsPlants = cache.jobsPlants;
+
+        // .. upload draw commands of the whole pass
+        auto& meshBuffers = mWorld.meshBuffers;
+        auto multiDraw = meshBuffers.supportsMultiDraw();
+        if (multiDraw)
         {
-            // sort by
-            // .. shader
-            // .. material
-            // .. front-to-back
-            std::sort(jobsTerrain.begin(), jobsTerrain.end(), [](TerrainJob const& a, TerrainJob const& b) {
-                if (a.program != b.program)
-                    return a.program < b.program;
-                if (a.mat != b.mat)
-                    return a.mat < b.mat;
-                return a.camDis < b.camDis;
-            });
+            auto& commands = cache.drawCommands;
+            auto& origins = cache.drawOrigins;
+            commands.clear();
+            origins.clear();
+            for (auto const& job : jobsTerrain)
+            {
+                commands.push_back({GLuint(job.indexCount), 1u, 0u, job.baseVertex, GLuint(origins.size())});
+                origins.push_back(job.chunkOrigin);
+            }
+            meshBuffers.setDraws(commands, origins);
         }
 
         // .. render per shader
@@ -739,6 +1148,8 @@ void Assignment10::renderScene(camera::CameraBase* cam, RenderPass pass)
                 auto program = jobsTerrain[idxShader].program;
                 setUpShader(program, cam, pass);
                 auto shader = program->use();
+                if (multiDraw)
+                    shader.setUniform("uChunkOrigin", glm::vec3(0)); // origins are per draw
 
                 // .. per material
                 auto idxMaterial = idxShader;
@@ -757,24 +1168,49 @@ void Assignment10::renderScene(camera::CameraBase* cam, RenderPass pass)
                     shader.setTexture("uTexHeight", mat->texHeight);
                     shader.setTexture("uTexRoughness", mat->texRoughness);
 
-                    // .. per mesh
-                    auto idxMesh = idxMaterial;
-                    while (idxMesh < jobsTerrain.size() && jobsTerrain[idxMesh].mat == mat)
+                    // .. per arena
+                    auto idxArena = idxMaterial;
+                    while (idxArena < jobsTerrain.size() && jobsTerrain[idxArena].mat == mat)
                     {
-                        auto mesh = jobsTerrain[idxMesh].mesh;
-
-                        // keep stats
-                        mStatsMeshesRendered[(int)pass]++;
-                        mStatsVerticesRendered[(int)pass] += mesh->getVertexCount();
-
-                        mesh->bind().draw(); // render
+                        auto arena = jobsTerrain[idxArena].mesh;
+                        auto vao = arena->bind();
+                        vao.negotiateBindings();
+
+                        // .. per mesh
+                        auto idxMesh = idxArena;
+                        while (idxMesh < jobsTerrain.size() && jobsTerrain[idxMesh].mat == mat && jobsTerrain[idxMesh].mesh == arena)
+                        {
+                            auto const& job = jobsTerrain[idxMesh];
+
+                            // keep stats
+                            mStatsMeshesRendered[(int)pass]++;
+                            mStatsVerticesRendered[(int)pass] += job.indexCount / 6 * 4;
+
+                            if (!multiDraw)
+                            {
+                                // vertex positions are chunk-local
+                                shader.setUniform("uChunkOrigin", job.chunkOrigin);
+
+                                // render the range of the mesh in its arena
+                                // (shared index buffer is larger than needed)
+                                glDrawElementsBaseVertex(GL_TRIANGLES, job.indexCount, GL_UNSIGNED_SHORT, nullptr, job.baseVertex);
+                            }
+
+                            // advance idx
+                            ++idxMesh;
+                        }
+
+                        // render all meshes of this material in this arena at once
+                        // (origins are per draw, see TerrainBuffers::setDraws)
+                        if (multiDraw)
+                            meshBuffers.multiDraw(idxArena, idxMesh - idxArena);
 
                         // advance idx
-                        ++idxMesh;
+                        idxArena = idxMesh;
                     }
 
                     // advance idx
-                    idxMaterial = idxMesh;
+                    idxMaterial = idxArena;
                 }
 
                 // advance idx
@@ -1057,6 +1493,7 @@ void Assignment10::init()
 
         // objects
         mShaderLineTransparent = Program::createFromFile(shaderPath + "objects/line.transparent");
+        mShaderOcclusionBox = Program::createFromFile(shaderPath + "objects/occlusion-box");
         mShaderPlants = Program::createFromFile(shaderPath + "objects/plants");
 
         // terrain
@@ -1265,11 +1702,40 @@ void Assignment10::updateShadowMapTexture()
         cascade.framebuffer = Framebuffer::create({{"fShadow", mShadowMaps, 0, i}}, shadowDepth);
     }
 
+    // contents are lost
+    for (auto& cascade : mShadowCascades)
+        cascade.needsRender = true;
+
     // shadow blur texture/target
     mShadowBlurTarget = Texture2D::createStorageImmutable(mShadowMapSize, mShadowMapSize, GL_R32F, 1);
     mFramebufferShadowBlur = Framebuffer::create({{"fShadow", mShadowBlurTarget}});
 }
 
+int Assignment10::selectLod(Chunk const& chunk) const
+{
+    auto cam = getCamera();
+    auto camPos = cam->getPosition();
+    auto dis = distance(clamp(camPos, glm::vec3(chunk.chunkPos), glm::vec3(chunk.chunkPos + CHUNK_SIZE)), camPos);
+    if (dis < CHUNK_SIZE)
+        return 0; // always full detail around the camera
+
+    // projected size of one meter at that distance
+    auto pixelsPerMeter = cam->getViewportHeight() / (2.0f * dis * glm::tan(glm::radians(cam->getVerticalFieldOfView() * 0.5f)));
+
+    // level l merges 2^l blocks, i.e. surfaces move by up to 2^l - 1 blocks
+    // (switching to a coarser level requires a 20% lower error to avoid flickering at the threshold)
+    auto lod = 0;
+    while (lod + 1 < LOD_LEVELS)
+    {
+        auto error = ((1 << (lod + 1)) - 1) * pixelsPerMeter;
+        auto maxError = lod + 1 > chunk.getMeshLod() ? mLodPixelError * 0.8f : mLodPixelError;
+        if (error > maxError)
+            break;
+        ++lod;
+    }
+    return lod;
+}
+
 bool Assignment10::onMouseButton(double x, double y, int button, int action, int mods, int clickCount)
 {
     if (GlfwApp::onMouseButton(x, y, button, action, mods, clickCount))
@@ -1284,7 +1750,7 @@ bool Assignment10::onMouseButton(double x, double y, int button, int action, int
         auto blockMat = mMouseHit.block.mat;
         if (mods & GLFW_MOD_CONTROL)
         {
-            mWorld.queryBlockMutable(bPos).mat = 0;
+            mWorld.setBlock(bPos, Block::air());
             modified = true;
             // glow::info() << "Removing material " << int(mMouseHit.block.mat) << " at " << bPos;
         }
@@ -1297,7 +1763,7 @@ bool Assignment10::onMouseButton(double x, double y, int button, int action, int
         else // no modifier -> add material
         {
             bPos += mMouseHit.hitNormal;
-            mWorld.queryBlockMutable(bPos).mat = mCurrentMaterial;
+            mWorld.setBlock(bPos, Block(mCurrentMaterial));
             modified = true;
             // glow::info() << "Adding material " << int(mCurrentMaterial) << " at " << bPos;
         }
@@ -1354,6 +1820,17 @@ void Assignment10::onResize(int w, int h)
         t.target->bind().resize(w >> t.downsampled, h >> t.downsampled);
 }
 
+static void TW_CALL ButtonBenchmarkChunkLookup(void*)
+{
+    benchmarks::chunkLookup(10 * 1000);
+    benchmarks::chunkLookup(100 * 1000);
+}
+
+static void TW_CALL ButtonBenchmarkMeshing(void* data)
+{
+    benchmarks::meshing(*(World const*)data);
+}
+
 void Assignment10::setUpTweakBar()
 {
     TwAddVarRW(tweakbar(), "Light Dir", TW_TYPE_DIR3F, &mLightDir, "group=rendering");
@@ -1387,8 +1864,23 @@ void Assignment10::setUpTweakBar()
     TwAddVarRW(tweakbar(), "Render Distance", TW_TYPE_FLOAT, &mRenderDistance, "group=culling min=1 max=1000");
     TwAddVarRW(tweakbar(), "Frustum Culling", TW_TYPE_BOOLCPP, &mEnableFrustumCulling, "group=culling");
     TwAddVarRW(tweakbar(), "Custom BFC", TW_TYPE_BOOLCPP, &mEnableCustomBFC, "group=culling");
+    TwAddVarRW(tweakbar(), "Occlusion Culling", TW_TYPE_BOOLCPP, &mEnableOcclusionCulling, "group=culling");
+    TwAddVarRW(tweakbar(), "Software Occlusion", TW_TYPE_BOOLCPP, &mEnableSoftwareOcclusion, "group=culling");
+    TwAddVarRW(tweakbar(), "Max Occluders", TW_TYPE_INT32, &mMaxOccluders, "group=culling min=0 max=4096");
+
+    TwAddVarRW(tweakbar(), "Eviction Margin", TW_TYPE_FLOAT, &mWorld.evictionMargin, "group=world min=0 max=500");
+    TwAddVarRW(tweakbar(), "Greedy Meshing", TW_TYPE_BOOLCPP, &mGreedyMeshing, "group=world");
+    TwAddVarRW(tweakbar(), "Level of Detail", TW_TYPE_BOOLCPP, &mEnableLod, "group=world");
+    TwAddVarRW(tweakbar(), "LOD Error (px)", TW_TYPE_FLOAT, &mLodPixelError, "group=world min=0.5 max=100");
+    TwAddVarRW(tweakbar(), "Memory Budget (MB)", TW_TYPE_INT32, &mWorld.memoryBudgetMB, "group=world min=16 max=16384");
+    TwAddVarRW(tweakbar(), "Upload Budget (KB)", TW_TYPE_INT32, &mWorld.meshUploadBudgetKB, "group=world min=0 max=262144");
+    TwAddVarRW(tweakbar(), "Cache Generated Chunks", TW_TYPE_BOOLCPP, &mWorld.cacheGeneratedChunks, "group=world");
 
     TwAddVarRO(tweakbar(), "# Chunks", TW_TYPE_INT32, &mStatsChunksGenerated, "group=stats");
+    TwAddVarRO(tweakbar(), "Blocks (CPU, MB)", TW_TYPE_FLOAT, &mStatsBlockMemoryMB, "group=stats");
+    TwAddVarRO(tweakbar(), "Meshes (GPU, MB)", TW_TYPE_FLOAT, &mStatsMeshMemoryMB, "group=stats");
+    TwAddVarRO(tweakbar(), "Mesh Uploads (KB)", TW_TYPE_FLOAT, &mStatsMeshUploadKB, "group=stats");
+    TwAddVarRO(tweakbar(), "Occluders", TW_TYPE_INT32, &mStatsOccluders, "group=stats");
     TwAddVarRO(tweakbar(), "Z-Pre: Meshes", TW_TYPE_INT32, &mStatsMeshesRendered[(int)RenderPass::DepthPre], "group=stats");
     TwAddVarRO(tweakbar(), "Z-Pre: Vertices", TW_TYPE_INT32, &mStatsVerticesRendered[(int)RenderPass::DepthPre], "group=stats");
     TwAddVarRO(tweakbar(), "Z-Pre: Vertices / Mesh", TW_TYPE_FLOAT, &mStatsVerticesPerMesh[(int)RenderPass::DepthPre], "group=stats");
@@ -1401,6 +1893,10 @@ void Assignment10::setUpTweakBar()
     TwAddVarRO(tweakbar(), "Shadow: Meshes", TW_TYPE_INT32, &mStatsMeshesRendered[(int)RenderPass::Shadow], "group=stats");
     TwAddVarRO(tweakbar(), "Shadow: Vertices", TW_TYPE_INT32, &mStatsVerticesRendered[(int)RenderPass::Shadow], "group=stats");
     TwAddVarRO(tweakbar(), "Shadow: Vertices / Mesh", TW_TYPE_FLOAT, &mStatsVerticesPerMesh[(int)RenderPass::Shadow], "group=stats");
+    TwAddVarRO(tweakbar(), "Shadow: Cascades Rendered", TW_TYPE_INT32, &mStatsShadowCascadesRendered, "group=stats");
+
+    TwAddButton(tweakbar(), "Chunk Lookup", ButtonBenchmarkChunkLookup, nullptr, "group=benchmarks");
+    TwAddButton(tweakbar(), "Meshing", ButtonBenchmarkMeshing, &mWorld, "group=benchmarks");
 
     // debug target
     TwEnumVal targetsEV[] = {
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <array>
+#include <map>
+#include <memory>
 #include <vector>
 
 #include <glm/ext.hpp>
@@ -14,7 +17,11 @@
 
 #include "Character.hh"
 #include "Chunk.hh"
+#include "CullingTree.hh"
+#include "FrustumCuller.hh"
 #include "Material.hh"
+#include "SoftwareOcclusion.hh"
+#include "TaskPool.hh"
 #include "World.hh"
 
 enum class RenderPass
@@ -108,6 +115,7 @@ private: // object gfx
 
     // objects
     glow::SharedProgram mShaderLineTransparent;
+    glow::SharedProgram mShaderOcclusionBox;
     glow::SharedProgram mShaderPlants;
     glow::SharedTexture2D mTexPlants;
 
@@ -161,6 +169,17 @@ private: // rendering pipeline
         glow::camera::FixedCamera camera;
         float minRange = -1;
         float maxRange = -1;
+
+        /// part of the camera frustum covered by this cascade (for caster culling, see FrustumCuller::addCasterVolume)
+        std::array<glm::vec3, 8> sliceCorners;
+        float casterMargin = 0.0f; ///< for filtering and blurring near the border of the part
+
+        /// shadow maps are only re-rendered if their bounds, settings or casters changed
+        bool needsRender = true;
+        glm::mat4 renderedViewProj;
+        float renderedExponent = 0.0f;
+        bool renderedShadows = false;
+        bool renderedSoftShadows = false;
     };
     glow::SharedTexture2DArray mShadowMaps;
     std::vector<ShadowCascade> mShadowCascades;
@@ -170,6 +189,9 @@ private: // rendering pipeline
     float mShadowRange = 200.0f;
     glow::SharedFramebuffer mFramebufferShadowBlur;
     glow::SharedTexture2D mShadowBlurTarget;
+    /// mesh generation up to which changes were checked against the cascades
+    int mShadowMeshGeneration = -1;
+    std::vector<glm::ivec3> mShadowChangedChunks;
 
     // Depth Pre-Pass
     glow::SharedFramebuffer mFramebufferDepthPre;
@@ -248,16 +270,147 @@ private: // rendering pipeline
     float mRenderDistance = 32;
     bool mEnableCustomBFC = true;
     bool mEnableFrustumCulling = true;
+    bool mEnableOcclusionCulling = true; ///< requires the depth pre-pass
+    bool mEnableSoftwareOcclusion = true;
+    int mMaxOccluders = 256; ///< nearest fully solid chunks in the software depth buffer
+
+    // meshing
+    bool mGreedyMeshing = false;
+
+    // level of detail
+    bool mEnableLod = true;
+    float mLodPixelError = 16.0f; ///< max. screen-space error of distant chunk meshes (in pixels)
 
     // debug
     bool mBackFaceCulling = true;
 
     // stats
     int mStatsChunksGenerated = -1;
+    float mStatsBlockMemoryMB = 0.0f;
+    float mStatsMeshMemoryMB = 0.0f;
+    float mStatsMeshUploadKB = 0.0f; ///< last frame
+    int mStatsOccluders = 0;
+    int mStatsShadowCascadesRendered = 0;
     int mStatsMeshesRendered[4];
     int mStatsVerticesRendered[4];
     float mStatsVerticesPerMesh[4];
 
+private: // render jobs
+    struct TerrainJob
+    {
+        glow::Program* program;
+        RenderMaterial const* mat;
+        glow::VertexArray* mesh; ///< arena geometry (see TerrainBuffers)
+        int baseVertex;
+        int indexCount;
+        glm::vec3 chunkOrigin;
+        float camDis;
+    };
+    struct PlantJob
+    {
+        glow::VertexArray* mesh;
+        float camDis;
+    };
+
+    /// hardware occlusion culling (state is stored per chunk, see Chunk::occlusion)
+    /// chunks to test in this frame (see renderDepthPrePass)
+    std::vector<Chunk*> mOcclusionTests;
+    int mOcclusionFrame = 0;
+
+    /// CPU depth buffer of the nearest fully solid chunks (rebuilt every frame for the main camera)
+    /// chunks are tested against it before their render jobs are collected (no GL work at all)
+    SoftwareOcclusion mSoftwareOcclusion;
+    int mSoftwareOcclusionFrame = 0;
+    std::vector<std::pair<float, Chunk const*>> mOccluderCandidates;
+
+    /// a mesh that may be rendered in a pass (render job + culling data)
+    struct RenderCandidate
+    {
+        TerrainJob job; ///< camDis as of the last re-sort
+        int id;         ///< item id in the culling tree
+        glm::ivec3 chunkPos;
+        glm::ivec3 dir;
+        glm::vec3 aabbMin;
+        glm::vec3 aabbMax;
+        glow::VertexArray* plants; ///< nullptr if the mesh has no plants (or not the opaque pass)
+        Chunk* occluded; ///< for occlusion culling, nullptr in the shadow pass (only dereferenced for current candidates)
+    };
+
+    /// render jobs of a consecutive range of visible candidates (collected by one task, see cullScene)
+    struct CullBlock
+    {
+        int begin; ///< index into RenderJobCache::visible
+        int end;
+        std::vector<TerrainJob> jobsTerrain;
+        std::vector<PlantJob> jobsPlants;
+        std::vector<Chunk*> occlusionTests; ///< might contain duplicates
+    };
+
+    /// persistent render jobs of a (pass, camera) pair
+    /// candidates are updated incrementally from the mesh change log of the world
+    /// and re-sorted (nearly sorted, insertion sort) when the camera enters another cell
+    /// culling is hierarchical over chunk columns (tree is rebuilt when meshes change)
+    struct RenderJobCache
+    {
+        int meshGeneration = -1;
+        bool hasSortCell = false;
+        glm::ivec3 sortCell;
+
+        /// sorted by shader, material, arena and front-to-back
+        std::vector<RenderCandidate> candidates;
+
+        /// candidates by column, item ids are indices into `positions`
+        CullingTree tree{CHUNK_SIZE};
+        /// current index of a candidate in `candidates` by id
+        std::vector<int> positions;
+
+        // per frame (allocations are re-used)
+        std::unique_ptr<FrustumCuller> culler;
+        std::vector<glm::ivec3> changedChunks;
+        std::vector<CullingTree::Item> treeItems;
+        std::vector<int> visible;
+        std::vector<CullBlock> blocks; ///< the first blockCount are used
+        int blockCount = 0;
+        std::vector<TerrainJob> jobsTerrain;
+        std::vector<PlantJob> jobsPlants;
+        std::vector<TerrainBuffers::DrawCommand> drawCommands;
+        std::vector<glm::vec3> drawOrigins;
+    };
+    std::map<std::pair<RenderPass, glow::camera::CameraBase const*>, RenderJobCache> mRenderJobCaches;
+
+    /// a pass rendered from a camera in this frame (see cullScene)
+    struct CullView
+    {
+        glow::camera::CameraBase* cam;
+        RenderPass pass;
+        ShadowCascade const* cascade; ///< nullptr if not a shadow pass
+        RenderJobCache* cache;
+    };
+    std::vector<CullView> mCullViews;
+    std::vector<std::pair<int, int>> mCullTasks; ///< (view, block)
+
+    /// threads for per-frame culling
+    TaskPool mTaskPool;
+
+    /// render order of terrain jobs: shader, material, arena (one multi-draw per arena), front-to-back
+    static bool isRenderedBefore(TerrainJob const& a, TerrainJob const& b);
+
+    /// collects the render jobs of all views of this frame (shadow cascades, depth pre-pass, opaque, transparent)
+    /// views and blocks of their visible candidates are processed in parallel (see mTaskPool)
+    void cullScene();
+    /// updates the candidates of a cache and culls them hierarchically with cache.culler (fills `visible`, thread-safe per cache)
+    void updateRenderCandidates(RenderJobCache& cache, glow::camera::CameraBase* cam, RenderPass pass);
+    /// collects the render jobs of a block of visible candidates (thread-safe per block)
+    void collectRenderJobs(RenderJobCache const& cache, glow::camera::CameraBase* cam, RenderPass pass, CullBlock& block) const;
+
+    /// reads available occlusion results (non-blocking)
+    void updateOcclusionResults();
+    /// issues occlusion queries for the bounding boxes of mOcclusionTests (after the depth pre-pass)
+    void issueOcclusionQueries(glow::camera::CameraBase* cam);
+
+    /// rasterizes the nearest visible fully solid chunks into mSoftwareOcclusion
+    void updateSoftwareOcclusion(glow::camera::CameraBase* cam);
+
 private: // gfx options
     /// accumulated time
     double mRuntime = 0.0f;
@@ -281,6 +434,9 @@ private: // helper
     /// Updates shadow map texture if size changed
     void updateShadowMapTexture();
 
+    /// selects the coarsest level of detail whose screen-space error is below mLodPixelError
+    int selectLod(Chunk const& chunk) const;
+
     /// Registers tweakbar entries
     void setUpTweakBar();
 
@@ -300,6 +456,10 @@ private: // rendering
     /// renders the scene for a render pass
     void renderScene(glow::camera::CameraBase* cam, RenderPass pass);
 
+    /// sets up the cameras of the shadow cascades with stable, texel-snapped bounds (before culling)
+    /// and decides which cascades have to be re-rendered
+    void updateShadowCascades();
+
     // pipeline passes
     void renderShadowPass();
     void renderDepthPrePass();
@@ -0,0 +1,155 @@
+#include "Benchmarks.hh"
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/gtx/hash.hpp>
+
+#include <glow/common/log.hh>
+
+#include <glow-extras/timing/PerformanceTimer.hh>
+
+#include "Chunk.hh"
+#include "ChunkMap.hh"
+#include "MeshGenerator.hh"
+#include "World.hh"
+
+void benchmarks::chunkLookup(int chunkCount)
+{
+    // chunk positions: square of columns with 4 chunks each
+    std::vector<glm::ivec3> positions;
+    auto side = (int)glm::ceil(glm::sqrt(chunkCount / 4.0f));
+    for (auto x = 0; x < side && (int)positions.size() < chunkCount; ++x)
+        for (auto z = 0; z < side && (int)positions.size() < chunkCount; ++z)
+            for (auto y = 0; y < 4 && (int)positions.size() < chunkCount; ++y)
+                positions.push_back(glm::ivec3(x - side / 2, y, z - side / 2) * CHUNK_SIZE);
+
+    // queries: 3/4 hits, 1/4 misses (just outside the area)
+    const int queryCount = 4 * 1000 * 1000;
+    std::vector<glm::ivec3> queries(queryCount);
+    std::default_random_engine rng(1234);
+    std::uniform_int_distribution<int> idx(0, positions.size() - 1);
+    for (auto i = 0; i < queryCount; ++i)
+    {
+        queries[i] = positions[idx(rng)];
+        if (i % 4 == 3)
+            queries[i].y += 4 * CHUNK_SIZE;
+    }
+
+    std::unordered_map<glm::ivec3, SharedChunk> stdMap;
+    ChunkMap flatMap;
+
+    glow::timing::SystemTimer timer;
+
+    // insertion
+    timer.restart();
+    for (auto const& p : positions)
+        stdMap[p] = Chunk::create(p, nullptr);
+    auto stdInsert = timer.getTimeDiffInSecondsD();
+
+    timer.restart();
+    for (auto const& p : positions)
+        flatMap[p] = stdMap[p];
+    auto flatInsert = timer.getTimeDiffInSecondsD();
+
+    // lookup
+    int64_t stdHits = 0;
+    timer.restart();
+    for (auto const& q : queries)
+    {
+        auto it = stdMap.find(q);
+        if (it != stdMap.end())
+            stdHits += it->second->chunkPos.x & 1;
+    }
+    auto stdLookup = timer.getTimeDiffInSecondsD();
+
+    int64_t flatHits = 0;
+    timer.restart();
+    for (auto const& q : queries)
+    {
+        auto c = flatMap.get(q);
+        if (c)
+            flatHits += c->chunkPos.x & 1;
+    }
+    auto flatLookup = timer.getTimeDiffInSecondsD();
+
+    if (stdHits != flatHits)
+        glow::error() << "ChunkMap lookup mismatch: " << flatHits << " vs " << stdHits;
+
+    auto nsPerQuery = [&](double s) { return s * 1e9 / queryCount; };
+    glow::info() << "[Benchmark] chunk lookup, " << positions.size() << " chunks, " << queryCount << " queries";
+    glow::info() << "  std::unordered_map: insert " << stdInsert * 1000 << " ms, lookup " << nsPerQuery(stdLookup) << " ns/query";
+    glow::info() << "  ChunkMap:           insert " << flatInsert * 1000 << " ms, lookup " << nsPerQuery(flatLookup) << " ns/query";
+}
+
+void benchmarks::meshing(World const& world)
+{
+    // meshed area: 6x2x6 chunks around the origin (surface level)
+    const int areaXZ = 6;
+    const int minY = -1;
+    const int maxY = 0;
+
+    // generate area + 1 chunk border
+    std::map<std::tuple<int, int, int>, BlockStorage> storages;
+    for (auto z = -1; z <= areaXZ; ++z)
+        for (auto y = minY - 1; y <= maxY + 1; ++y)
+            for (auto x = -1; x <= areaXZ; ++x)
+                storages[std::make_tuple(x, y, z)] = world.generate(glm::ivec3(x, y, z) * CHUNK_SIZE);
+
+    // padded block arrays (same layout as World::snapshotNeighborhood)
+    struct Input
+    {
+        glm::ivec3 chunkPos;
+        std::vector<Block> blocks;
+    };
+    std::vector<Input> inputs;
+    auto cs = CHUNK_SIZE + 2;
+    for (auto z = 0; z < areaXZ; ++z)
+        for (auto y = minY; y <= maxY; ++y)
+            for (auto x = 0; x < areaXZ; ++x)
+            {
+                Input in;
+                in.chunkPos = glm::ivec3(x, y, z) * CHUNK_SIZE;
+                in.blocks.resize(cs * cs * cs);
+                for (auto bz = 0; bz < cs; ++bz)
+                    for (auto by = 0; by < cs; ++by)
+                        for (auto bx = 0; bx < cs; ++bx)
+                        {
+                            auto gp = in.chunkPos + glm::ivec3(bx, by, bz) - 1;
+                            auto cp = glm::ivec3(glm::floor(glm::vec3(gp) / float(CHUNK_SIZE)));
+                            auto rp = gp - cp * CHUNK_SIZE;
+                            auto const& st = storages[std::make_tuple(cp.x, cp.y, cp.z)];
+                            in.blocks[(bz * cs + by) * cs + bx] = st.get(Chunk::blockIndex(rp));
+                        }
+                inputs.push_back(std::move(in));
+            }
+
+    glow::timing::SystemTimer timer;
+    auto run = [&](bool greedy, SectionMask sections, double& seconds, size_t& vertices) {
+        vertices = 0;
+        timer.restart();
+        for (auto const& in : inputs)
+            for (auto const& m : generateMesh(in.blocks, in.chunkPos, world, greedy, 0, sections, sections != allSections))
+                vertices += m.vertexData.size();
+        seconds = timer.getTimeDiffInSecondsD();
+    };
+
+    double secondsFaces, secondsGreedy, secondsSection;
+    size_t verticesFaces, verticesGreedy, verticesSection;
+    run(false, allSections, secondsFaces, verticesFaces);
+    run(true, allSections, secondsGreedy, verticesGreedy);
+
+    // a block edit re-meshes the sections around it (here: a single section in the chunk center)
+    auto center = glm::ivec3(CHUNK_SIZE / 2);
+    run(false, sectionsIn(center, center), secondsSection, verticesSection);
+
+    glow::info() << "[Benchmark] meshing, " << inputs.size() << " chunks";
+    glow::info() << "  per-face: " << secondsFaces * 1000 << " ms, " << verticesFaces << " vertices";
+    glow::info() << "  greedy:   " << secondsGreedy * 1000 << " ms, " << verticesGreedy << " vertices ("
+                 << (verticesGreedy > 0 ? double(verticesFaces) / verticesGreedy : 0.0) << "x fewer)";
+    glow::info() << "  1 section: " << secondsSection * 1000 / inputs.size() << " ms per chunk, " << verticesSection << " vertices";
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+class World;
+
+/// Micro-benchmarks for performance-critical parts of the terrain
+/// Results are written to the log (glow::info)
+namespace benchmarks
+{
+/// compares chunk lookups in std::unordered_map vs. ChunkMap
+/// (`chunkCount` chunks in a flat square around the origin, random hits + misses)
+void chunkLookup(int chunkCount);
+
+/// compares per-face and greedy meshing (time and vertex count) on a fixed area of generated terrain
+/// and measures partial re-meshing of a single section (as done for block edits)
+/// (terrain generation is deterministic, so results are comparable across runs)
+void meshing(World const& world);
+}
@@ -0,0 +1,263 @@
+#include "BlockStorage.hh"
+
+#include <algorithm>
+#include <cassert>
+
+#include <aion/common/snappy/snappy.hh>
+
+BlockStorage::BlockStorage(Block b)
+{
+    fill(b);
+}
+
+int BlockStorage::bitsFor(int paletteSize)
+{
+    if (paletteSize <= 1)
+        return 0;
+    if (paletteSize <= 2)
+        return 1;
+    if (paletteSize <= 4)
+        return 2;
+    if (paletteSize <= 16)
+        return 4;
+    return 8;
+}
+
+int BlockStorage::paletteIndexOf(int8_t mat) const
+{
+    for (auto i = 0u; i < mPalette.size(); ++i)
+        if (mPalette[i] == mat)
+            return i;
+    return -1;
+}
+
+void BlockStorage::set(int idx, Block b)
+{
+    if (mBits == 0)
+    {
+        if (b.mat == mUniform.mat)
+            return; // no change
+
+        // leave uniform mode: all existing indices are 0
+        mPalette = {mUniform.mat};
+    }
+
+    auto pi = paletteIndexOf(b.mat);
+
+    // new material -> extend palette (and maybe index width)
+    if (pi < 0)
+    {
+        mPalette.push_back(b.mat);
+        pi = mPalette.size() - 1;
+
+        auto newBits = bitsFor(mPalette.size());
+        if (newBits != mBits)
+            repack(newBits);
+    }
+
+    if (mBits == 0)
+        return; // single material, nothing to write
+
+    auto perWord = 32 / mBits;
+    auto shift = (idx % perWord) * mBits;
+    auto mask = ((1u << mBits) - 1) << shift;
+    auto& word = mWords[idx / perWord];
+    word = (word & ~mask) | (uint32_t(pi) << shift);
+}
+
+void BlockStorage::fill(Block b)
+{
+    // release heap memory
+    std::vector<int8_t>().swap(mPalette);
+    std::vector<uint32_t>().swap(mWords);
+
+    mUniform = b;
+    mBits = 0;
+}
+
+void BlockStorage::assign(Block const* blocks)
+{
+    // build palette
+    int16_t lookup[256];
+    std::fill(std::begin(lookup), std::end(lookup), -1);
+
+    mPalette.clear();
+    for (auto i = 0; i < blockCount; ++i)
+    {
+        auto& e = lookup[uint8_t(blocks[i].mat)];
+        if (e < 0)
+        {
+            e = mPalette.size();
+            mPalette.push_back(blocks[i].mat);
+        }
+    }
+
+    // single material
+    if (mPalette.size() == 1)
+    {
+        fill(blocks[0]);
+        return;
+    }
+
+    // pack indices
+    mBits = bitsFor(mPalette.size());
+    mWords.clear();
+
+    auto perWord = 32 / mBits;
+    mWords.resize(blockCount / perWord);
+    for (auto w = 0u; w < mWords.size(); ++w)
+    {
+        uint32_t word = 0;
+        for (auto i = 0; i < perWord; ++i)
+            word |= uint32_t(lookup[uint8_t(blocks[w * perWord + i].mat)]) << (i * mBits);
+        mWords[w] = word;
+    }
+}
+
+void BlockStorage::copyRange(int idx, int count, Block* out) const
+{
+    assert(idx >= 0 && idx + count <= blockCount);
+
+    if (mBits == 0)
+    {
+        std::fill(out, out + count, mUniform);
+        return;
+    }
+
+    for (auto i = 0; i < count; ++i)
+        out[i] = Block(mPalette[rawIndex(idx + i)]);
+}
+
+void BlockStorage::compact()
+{
+    if (mBits == 0)
+        return; // already minimal
+
+    // find used entries
+    bool used[256] = {};
+    for (auto i = 0; i < blockCount; ++i)
+        used[rawIndex(i)] = true;
+
+    // build remapping
+    int remap[256];
+    std::vector<int8_t> newPalette;
+    for (auto i = 0u; i < mPalette.size(); ++i)
+    {
+        remap[i] = newPalette.size();
+        if (used[i])
+            newPalette.push_back(mPalette[i]);
+    }
+
+    if (newPalette.size() == mPalette.size())
+        return; // nothing unused
+
+    if (newPalette.size() == 1)
+    {
+        fill(Block(newPalette[0]));
+        return;
+    }
+
+    // re-pack with new indices
+    auto newBits = bitsFor(newPalette.size());
+    std::vector<uint32_t> newWords;
+    if (newBits > 0)
+    {
+        auto perWord = 32 / newBits;
+        newWords.resize(blockCount / perWord, 0u);
+        for (auto i = 0; i < blockCount; ++i)
+            newWords[i / perWord] |= uint32_t(remap[rawIndex(i)]) << ((i % perWord) * newBits);
+    }
+
+    mPalette = std::move(newPalette);
+    mWords = std::move(newWords);
+    mBits = newBits;
+}
+
+void BlockStorage::repack(int newBits)
+{
+    assert(newBits > mBits);
+
+    auto perWord = 32 / newBits;
+    std::vector<uint32_t> newWords(blockCount / perWord, 0u);
+    if (mBits > 0)
+        for (auto i = 0; i < blockCount; ++i)
+            newWords[i / perWord] |= uint32_t(rawIndex(i)) << ((i % perWord) * newBits);
+
+    mWords = std::move(newWords);
+    mBits = newBits;
+}
+
+void BlockStorage::encode(std::vector<char>& out) const
+{
+    // header: index width
+    out.push_back(char(mBits));
+
+    if (mBits == 0)
+    {
+        out.push_back(char(mUniform.mat));
+        return;
+    }
+
+    // palette
+    out.push_back(char(mPalette.size() - 1));
+    out.insert(out.end(), mPalette.begin(), mPalette.end());
+
+    // compressed indices
+    auto start = out.size();
+    auto rawSize = mWords.size() * sizeof(uint32_t);
+    out.resize(start + snappy::MaxCompressedLength(rawSize));
+    size_t compressedSize;
+    snappy::RawCompress((char const*)mWords.data(), rawSize, out.data() + start, &compressedSize);
+    out.resize(start + compressedSize);
+}
+
+bool BlockStorage::decode(char const* data, size_t size)
+{
+    fill(Block::invalid());
+
+    if (size < 2)
+        return false;
+
+    auto bits = int(uint8_t(data[0]));
+    if (bits == 0)
+    {
+        fill(Block(int8_t(data[1])));
+        return true;
+    }
+
+    if (bits != 1 && bits != 2 && bits != 4 && bits != 8)
+        return false;
+
+    auto paletteSize = size_t(uint8_t(data[1])) + 1;
+    if (paletteSize < 2 || paletteSize > (1u << bits) || size < 2 + paletteSize)
+        return false;
+
+    auto compressed = data + 2 + paletteSize;
+    auto compressedSize = size - 2 - paletteSize;
+    auto rawSize = size_t(blockCount / (32 / bits)) * sizeof(uint32_t);
+
+    size_t uncompressedSize;
+    if (!snappy::GetUncompressedLength(compressed, compressedSize, &uncompressedSize) || uncompressedSize != rawSize)
+        return false;
+
+    mWords.resize(rawSize / sizeof(uint32_t));
+    if (!snappy::RawUncompress(compressed, compressedSize, (char*)mWords.data()))
+    {
+        fill(Block::invalid());
+        return false;
+    }
+
+    mPalette.assign(data + 2, data + 2 + paletteSize);
+    mBits = bits;
+
+    // unused index values must not appear
+    if (paletteSize < (1u << bits))
+        for (auto i = 0; i < blockCount; ++i)
+            if (rawIndex(i) >= (int)paletteSize)
+            {
+                fill(Block::invalid());
+                return false;
+            }
+
+    return true;
+}
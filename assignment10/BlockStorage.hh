@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Block.hh"
+#include "Constants.hh"
+
+/// Palette-compressed storage for the CHUNK_SIZE^3 blocks of a chunk
+///
+/// Every distinct material of the chunk gets an entry in a small palette,
+/// the blocks themselves only store bit-packed indices into that palette.
+/// The index width grows automatically (0, 1, 2, 4, 8 bits) when new materials are added.
+///
+/// Index layout is the same as for a flat array: (z * CHUNK_SIZE + y) * CHUNK_SIZE + x
+/// Since 32 is divisible by all index widths, an index never straddles two words.
+///
+/// Single-material ("uniform") storage uses no heap memory at all:
+/// palette and indices are empty and the block is stored in mUniform.
+class BlockStorage
+{
+public:
+    static const int blockCount = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE;
+
+private:
+    /// the block of a uniform storage (only valid if mBits == 0)
+    Block mUniform;
+
+    /// material per palette entry (empty if uniform)
+    std::vector<int8_t> mPalette;
+
+    /// bit-packed palette indices
+    std::vector<uint32_t> mWords;
+
+    /// number of bits per index (0, 1, 2, 4, or 8)
+    int mBits = 0;
+
+public: // ctor
+    /// creates storage where every block is `b`
+    explicit BlockStorage(Block b = Block::invalid());
+
+public: // properties
+    /// number of bits per block
+    int bitsPerBlock() const { return mBits; }
+
+    /// true iff all blocks are the same (no heap storage)
+    bool isUniform() const { return mBits == 0; }
+    /// the block of a uniform storage (only valid if isUniform())
+    Block uniformBlock() const { return mUniform; }
+
+    /// list of materials that (might) appear in this storage
+    std::vector<int8_t> materials() const { return mBits == 0 ? std::vector<int8_t>{mUniform.mat} : mPalette; }
+
+    /// approximate number of heap bytes used by this storage
+    size_t memoryBytes() const { return mPalette.capacity() + mWords.capacity() * sizeof(uint32_t); }
+
+public: // accessors
+    /// returns the block at a given linear index
+    Block get(int idx) const
+    {
+        if (mBits == 0)
+            return mUniform;
+
+        auto perWord = 32 / mBits;
+        auto word = mWords[idx / perWord];
+        auto shift = (idx % perWord) * mBits;
+        return Block(mPalette[(word >> shift) & ((1u << mBits) - 1)]);
+    }
+
+    /// sets the block at a given linear index
+    /// (might grow the palette and re-pack all indices)
+    void set(int idx, Block b);
+
+    /// sets all blocks to `b`
+    void fill(Block b);
+
+    /// replaces all blocks by a flat array of blockCount blocks
+    void assign(Block const* blocks);
+
+    /// decodes `count` consecutive blocks starting at `idx` into `out`
+    void copyRange(int idx, int count, Block* out) const;
+
+    /// removes unused palette entries and shrinks the index width if possible
+    /// collapses to a uniform storage if only one material is left
+    void compact();
+
+public: // serialization
+    /// appends a compact encoding of this storage to `out`
+    /// (palette is stored raw, indices are snappy-compressed)
+    void encode(std::vector<char>& out) const;
+
+    /// restores this storage from `size` bytes written by encode(...)
+    /// indices are decompressed directly into the storage (no intermediate buffer)
+    /// returns false (and leaves an invalid uniform storage) if the data is corrupt
+    bool decode(char const* data, size_t size);
+
+private: // helper
+    /// returns the palette index of a material (-1 if not found)
+    int paletteIndexOf(int8_t mat) const;
+
+    /// re-packs all indices with a new index width
+    void repack(int newBits);
+
+    /// reads the raw palette index at a linear index
+    int rawIndex(int idx) const
+    {
+        if (mBits == 0)
+            return 0;
+
+        auto perWord = 32 / mBits;
+        return (mWords[idx / perWord] >> ((idx % perWord) * mBits)) & ((1u << mBits) - 1);
+    }
+
+    /// smallest supported index width that can address `paletteSize` entries
+    static int bitsFor(int paletteSize);
+};
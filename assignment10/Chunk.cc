@@ -1,9 +1,12 @@
 #include "Chunk.hh"
 
+#include <algorithm>
 #include <set>
 
 #include <glm/ext.hpp>
 
+#include <glow/gl.hh>
+
 #include <glow/common/log.hh>
 #include <glow/common/profiling.hh>
 
@@ -13,17 +16,110 @@
 
 #include <glow-extras/geometry/Quad.hh>
 
+#include "TerrainBuffers.hh"
 #include "Vertices.hh"
 #include "World.hh"
 
 using namespace glow;
 
+namespace
+{
+/// number of quads reserved for a section of an editable mesh
+/// (a single block edit adds at most one face per material and direction)
+int sectionCapacity(int quadCount)
+{
+    return quadCount + quadCount / 4 + 4;
+}
+
+/// packed dir 0,1,2 negative, 3,4,5 positive
+int packedDir(glm::ivec3 d)
+{
+    auto pd = glm::abs(d);
+    auto s = (d.x + d.y + d.z + 1) / 2;
+    return pd.y + pd.z * 2 + s * 3;
+}
+
+/// uploads the plants of a mesh (small, uploaded completely)
+/// the plant buffer is only created for meshes with plants
+void uploadPlants(TerrainMesh &mesh)
+{
+    if (!mesh.abPlants)
+    {
+        if (mesh.plants.empty())
+            return;
+
+        mesh.abPlants = ArrayBuffer::create(Plant::attributes());
+        mesh.abPlants->setDivisor(1); // instancing
+        mesh.vaoPlants = geometry::Quad<>().generate();
+        mesh.vaoPlants->bind().attach(mesh.abPlants);
+    }
 
-Chunk::Chunk(glm::ivec3 chunkPos, World *world) : chunkPos(chunkPos), world(world)
+    mesh.abPlants->bind().setData(mesh.plants);
+}
+
+/// uploads all quads of a mesh, laid out per section
+/// editable meshes reserve spare quads per section (degenerate, all vertices at the chunk origin)
+/// the vertex range of the mesh is re-used if it is large enough (and not much too large)
+void uploadMesh(TerrainBuffers &buffers, TerrainMesh &mesh, TerrainMeshData const &data, bool editable)
 {
-    mBlocks.resize(CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE, Block::invalid());
+    auto const &start = data.sectionStart;
+
+    auto layout = [&](bool spare) {
+        mesh.sectionOffset.assign(SECTION_COUNT + 1, 0);
+        mesh.sectionCount.resize(SECTION_COUNT);
+        for (auto s = 0; s < SECTION_COUNT; ++s)
+        {
+            auto count = start[s + 1] - start[s];
+            mesh.sectionCount[s] = count;
+            mesh.sectionOffset[s + 1] = mesh.sectionOffset[s] + (spare ? sectionCapacity(count) : count);
+        }
+    };
+
+    layout(editable);
+    if (mesh.sectionOffset.back() > TerrainMesh::maxQuads)
+        layout(false); // no room for spare quads in the shared index buffer
+
+    auto quads = mesh.sectionOffset.back();
+    if (!mesh.vertices || mesh.vertices->quadCount < quads || mesh.vertices->quadCount > 2 * quads)
+        mesh.vertices = buffers.allocate(quads);
+    auto const &range = *mesh.vertices;
+
+    if (quads == data.quadCount())
+        buffers.upload(range, 0, data, 0, quads); // no spare quads
+    else
+    {
+        buffers.clear(range, 0, quads);
+        for (auto s = 0; s < SECTION_COUNT; ++s)
+            buffers.upload(range, mesh.sectionOffset[s], data, start[s], mesh.sectionCount[s]);
+    }
+    mesh.indexCount = quads * 6;
+
+    mesh.plants = data.plants;
+    mesh.plantSections = data.plantSections;
+    uploadPlants(mesh);
+
+    mesh.gpuBytes = range.quadCount * 4 * (sizeof(uint32_t) + sizeof(TerrainVertex)) + mesh.plants.size() * sizeof(Plant);
+}
+
+/// rewrites the quads of a section in place
+/// stale quads of the old contents become degenerate
+void uploadSection(TerrainBuffers &buffers, TerrainMesh &mesh, int section, TerrainMeshData const *data)
+{
+    auto newCount = data ? data->sectionStart[section + 1] - data->sectionStart[section] : 0;
+    auto oldCount = mesh.sectionCount[section];
+    auto offset = mesh.sectionOffset[section];
+
+    if (newCount > 0)
+        buffers.upload(*mesh.vertices, offset, *data, data->sectionStart[section], newCount);
+    if (oldCount > newCount)
+        buffers.clear(*mesh.vertices, offset + newCount, oldCount - newCount);
+
+    mesh.sectionCount[section] = newCount;
+}
 }
 
+Chunk::Chunk(glm::ivec3 chunkPos, World *world) : chunkPos(chunkPos), world(world), mBlocks(Block::invalid()) {}
+
 SharedChunk Chunk::create(glm::ivec3 chunkPos, World *world)
 {
     if (chunkPos.x % CHUNK_SIZE != 0 || chunkPos.y % CHUNK_SIZE != 0 || chunkPos.z % CHUNK_SIZE != 0)
@@ -39,12 +135,13 @@ const std::vector<TerrainMesh> &Chunk::queryMeshes()
     return mMeshes;
 }
 
-void Chunk::markDirty()
+void Chunk::markDirty(SectionMask sections)
 {
     if (!mIsDirty)
         world->notifyDirtyChunk(this); // enqueue CPU update
 
     mIsDirty = true;
+    mDirtySections |= sections;
 
     // Don't clear meshes: they might get re-used
     // mMeshes.clear();
@@ -55,6 +152,14 @@ void Chunk::update()
     if (!mIsDirty)
         return; // nothing to do
 
+    // block edits only touch a few sections
+    if (mDirtySections != allSections && !mBlocks.isUniform())
+    {
+        updateSections(mDirtySections);
+        mIsDirty = false;
+        return;
+    }
+
     mActiveLightFountains.clear();
 
     // recalc flags
@@ -68,15 +173,48 @@ void Chunk::update()
     glm::ivec3 amin(CHUNK_SIZE + 1);
     glm::ivec3 amax(-1);
 
-    auto idx = 0;
-    auto pChunk = mBlocks.data();
+    // drop materials that were overwritten
+    {
+        std::lock_guard<std::mutex> lock(mBlocksMutex);
+        mBlocks.compact();
+    }
+
+    // uniform chunks need no scan
+    if (mBlocks.isUniform())
+    {
+        auto b = mBlocks.uniformBlock();
+
+        mIsFullyAir = b.isAir();
+        mIsFullySolid = b.isSolid();
+
+        mAabbMin = glm::vec3(chunkPos);
+        mAabbMax = glm::vec3(chunkPos + CHUNK_SIZE);
+
+        // light fountains can only be in the top layer
+        auto mat = world->getMaterialFromIndex(b.mat);
+        if (!b.isInvalid() && mat && mat->spawnsLightSources)
+            for (auto z = 0; z < CHUNK_SIZE; ++z)
+                for (auto x = 0; x < CHUNK_SIZE; ++x)
+                {
+                    auto gp = chunkPos + glm::ivec3(x, CHUNK_SIZE - 1, z);
+                    if (queryBlock(gp + glm::ivec3(0, 1, 0)).isAir())
+                        mActiveLightFountains.push_back(gp);
+                }
+
+        mIsDirty = false;
+        return;
+    }
+
+    Block row[CHUNK_SIZE];
     auto fullAir = true;
     auto fullSolid = true;
     for (auto z = 0; z < CHUNK_SIZE; ++z)
         for (auto y = 0; y < CHUNK_SIZE; ++y)
+        {
+            copyBlocks({0, y, z}, CHUNK_SIZE, row);
             for (auto x = 0; x < CHUNK_SIZE; ++x)
             {
-                auto const &b = pChunk[idx++];
+                auto const &b = row[x];
                 glm::ivec3 p = {x, y, z}; // local position
 
                 // update flags
@@ -103,6 +241,7 @@ void Chunk::update()
                     }
                 }
             }
+        }
 
     mAabbMin = glm::vec3(chunkPos + amin);
     mAabbMax = glm::vec3(chunkPos + amax + 1);
@@ -113,26 +252,161 @@ void Chunk::update()
     mIsDirty = false;
 }
 
-void Chunk::notifyMeshData(const std::vector<TerrainMeshData> &meshData)
+void Chunk::updateSections(SectionMask sections)
+{
+    // light fountains of these sections are gathered again
+    mActiveLightFountains.erase(std::remove_if(mActiveLightFountains.begin(), mActiveLightFountains.end(),
+                                               [&](glm::ivec3 gp) { return (sections >> sectionOf(gp - chunkPos)) & 1; }),
+                                mActiveLightFountains.end());
+
+    Block row[SECTION_SIZE];
+    for (auto s = 0; s < SECTION_COUNT; ++s)
+    {
+        if (!((sections >> s) & 1))
+            continue;
+
+        auto origin = sectionOrigin(s);
+        for (auto z = 0; z < SECTION_SIZE; ++z)
+            for (auto y = 0; y < SECTION_SIZE; ++y)
+            {
+                copyBlocks(origin + glm::ivec3(0, y, z), SECTION_SIZE, row);
+                for (auto x = 0; x < SECTION_SIZE; ++x)
+                {
+                    auto const &b = row[x];
+
+                    // flags can only get lost through edits
+                    if (!b.isAir())
+                        mIsFullyAir = false;
+                    if (!b.isSolid())
+                        mIsFullySolid = false;
+
+                    if (b.isInvalid() || b.isAir())
+                        continue;
+
+                    // gather light fountains
+                    if (world->getMaterialFromIndex(b.mat)->spawnsLightSources)
+                    {
+                        auto gp = chunkPos + origin + glm::ivec3(x, y, z);
+                        if (queryBlock(gp + glm::ivec3(0, 1, 0)).isAir())
+                            mActiveLightFountains.push_back(gp);
+                    }
+                }
+            }
+    }
+}
+
+bool Chunk::notifyMeshData(const std::vector<TerrainMeshData> &meshData, SectionMask sections)
 {
     GLOW_ACTION();
 
+    auto &buffers = world->meshBuffers;
+
+    auto renderMaterialOf = [this](TerrainMeshData const &data) {
+        return world->getMaterialFromIndex(data.mat)->renderMaterials[packedDir(data.dir)];
+    };
+
+    // partial update: rewrite the given sections of the existing meshes in place
+    if (sections != allSections)
+    {
+        if (!mMeshesEditable)
+            return false;
+
+        // new data per existing mesh (null if the sections have no faces anymore)
+        std::vector<TerrainMeshData const *> sectionData(mMeshes.size(), nullptr);
+        std::vector<TerrainMeshData const *> addedData;
+        for (auto const &data : meshData)
+        {
+            auto mat = renderMaterialOf(data);
+            auto it = std::find_if(mMeshes.begin(), mMeshes.end(),
+                                   [&](TerrainMesh const &m) { return m.mat == mat && m.dir == data.dir; });
+            if (it != mMeshes.end())
+                sectionData[it - mMeshes.begin()] = &data;
+            else if (data.quadCount() > 0)
+                addedData.push_back(&data);
+        }
+
+        // all or nothing: check the reserved capacity first
+        for (auto i = 0u; i < mMeshes.size(); ++i)
+            for (auto s = 0; s < SECTION_COUNT; ++s)
+                if ((sections >> s) & 1)
+                {
+                    auto const &mesh = mMeshes[i];
+                    auto data = sectionData[i];
+                    auto count = data ? data->sectionStart[s + 1] - data->sectionStart[s] : 0;
+                    if (count > mesh.sectionOffset[s + 1] - mesh.sectionOffset[s])
+                        return false;
+                }
+
+        for (auto i = 0u; i < mMeshes.size(); ++i)
+        {
+            auto &mesh = mMeshes[i];
+            auto data = sectionData[i];
+
+            for (auto s = 0; s < SECTION_COUNT; ++s)
+                if ((sections >> s) & 1)
+                    uploadSection(buffers, mesh, s, data);
+
+            // bounding box only grows
+            if (data && data->quadCount() > 0)
+            {
+                mesh.aabbMin = min(mesh.aabbMin, data->aabbMin);
+                mesh.aabbMax = max(mesh.aabbMax, data->aabbMax);
+            }
+
+            // vegetation is small, it is uploaded completely
+            auto plantsChanged = data && !data->plants.empty();
+            auto keptPlants = 0u;
+            for (auto p = 0u; p < mesh.plants.size(); ++p)
+            {
+                if ((sections >> mesh.plantSections[p]) & 1)
+                {
+                    plantsChanged = true;
+                    continue;
+                }
+                mesh.plants[keptPlants] = mesh.plants[p];
+                mesh.plantSections[keptPlants] = mesh.plantSections[p];
+                ++keptPlants;
+            }
+
+            if (plantsChanged)
+            {
+                mesh.plants.resize(keptPlants);
+                mesh.plantSections.resize(keptPlants);
+                if (data)
+                {
+                    mesh.plants.insert(mesh.plants.end(), data->plants.begin(), data->plants.end());
+                    mesh.plantSections.insert(mesh.plantSections.end(), data->plantSections.begin(), data->plantSections.end());
+                }
+                uploadPlants(mesh);
+                mesh.gpuBytes = mesh.vertices->quadCount * 4 * (sizeof(uint32_t) + sizeof(TerrainVertex)) + mesh.plants.size() * sizeof(Plant);
+            }
+        }
+
+        // (material, direction) pairs without faces in other sections
+        for (auto data : addedData)
+        {
+            TerrainMesh mesh;
+            mesh.mat = renderMaterialOf(*data);
+            mesh.dir = data->dir;
+            mesh.aabbMin = data->aabbMin;
+            mesh.aabbMax = data->aabbMax;
+            uploadMesh(buffers, mesh, *data, true);
+            mMeshes.push_back(mesh);
+        }
+
+        return true;
+    }
+
     // upload new meshes
     std::vector<TerrainMesh> newMeshes;
 
     for (auto const &data : meshData)
     {
-        if (data.vertexData.empty())
+        if (data.quadCount() == 0)
             continue; // no data
 
-        auto d = data.dir;
-        auto pd = glm::abs(d);
-        auto s = (d.x + d.y + d.z + 1) / 2;
-        auto pdir = pd.y + pd.z * 2 + s * 3;
-        assert(0 <= pdir && pdir < 6);
-
         TerrainMesh mesh;
-        mesh.mat = world->getMaterialFromIndex(data.mat)->renderMaterials[pdir];
+        mesh.mat = renderMaterialOf(data);
         mesh.dir = data.dir;
         mesh.aabbMin = data.aabbMin;
         mesh.aabbMax = data.aabbMax;
@@ -141,35 +415,16 @@ void Chunk::notifyMeshData(const std::vector<TerrainMeshData> &meshData)
         for (auto const &m : mMeshes)
             if (m.mat == mesh.mat && m.dir == mesh.dir)
             {
-                mesh.abData = m.abData;
-                mesh.abPositions = m.abPositions;
-                mesh.vaoFull = m.vaoFull;
-                mesh.vaoPosOnly = m.vaoPosOnly;
+                mesh.vertices = m.vertices;
 
                 mesh.abPlants = m.abPlants;
                 mesh.vaoPlants = m.vaoPlants;
                 break;
             }
 
-        // .. otherwise create VAO/AB
-        if (!mesh.vaoFull)
-        {
-            mesh.abPositions = ArrayBuffer::create();
-            mesh.abPositions->defineAttribute<glm::vec3>("aPosition");
-            mesh.abData = ArrayBuffer::create(TerrainVertex::attributes());
-            mesh.vaoFull = VertexArray::create({mesh.abPositions, mesh.abData});
-            mesh.vaoPosOnly = VertexArray::create(mesh.abPositions);
-
-            mesh.abPlants = ArrayBuffer::create(Plant::attributes());
-            mesh.abPlants->setDivisor(1); // instancing
-            mesh.vaoPlants = geometry::Quad<>().generate();
-            mesh.vaoPlants->bind().attach(mesh.abPlants);
-        }
-
         // upload new vertex data
-        mesh.abPositions->bind().setData(data.vertexPositions);
-        mesh.abData->bind().setData(data.vertexData);
-        mesh.abPlants->bind().setData(data.plants);
+        // (allocates a new range if the old one does not fit)
+        uploadMesh(buffers, mesh, data, mMeshesEditable);
 
         // add to result
         newMeshes.push_back(mesh);
@@ -178,9 +433,10 @@ void Chunk::notifyMeshData(const std::vector<TerrainMeshData> &meshData)
     // replace old meshes
     mMeshes = newMeshes;
     // glow::info() << "new meshes for " << chunkPos;
+    return true;
 }
 
-const Block &Chunk::queryBlock(glm::ivec3 worldPos) const
+Block Chunk::queryBlock(glm::ivec3 worldPos) const
 {
     if (contains(worldPos))
         return block(worldPos - chunkPos);
@@ -190,10 +446,9 @@ const Block &Chunk::queryBlock(glm::ivec3 worldPos) const
 
 std::vector<Material const*> Chunk::queryMaterials() const
 {
-    std::set<int8_t> matIdx;
-
-    for (auto const& b : mBlocks)
-        matIdx.insert(b.mat);
+    // palette is compacted in update()
+    auto materials = mBlocks.materials();
+    std::set<int8_t> matIdx(materials.begin(), materials.end());
 
     std::vector<Material const*> mats;
 
@@ -207,3 +462,53 @@ std::vector<Material const*> Chunk::queryMaterials() const
 
     return mats;
 }
+
+bool Chunk::requestMesh(const std::array<std::weak_ptr<Chunk>, 27> &neighbors, MeshRequest const &request)
+{
+    std::lock_guard<std::mutex> lock(mMeshMutex);
+    auto sections = mMeshRequested ? mMeshRequest.sections | request.sections : request.sections;
+    mMeshNeighbors = neighbors;
+    mMeshRequest = request;
+    mMeshRequest.sections = sections;
+    mMeshRequested = true;
+    mMeshVersion++;
+
+    auto wasActive = mMeshJobActive;
+    mMeshJobActive = true;
+    return !wasActive;
+}
+
+std::array<SharedChunk, 27> Chunk::takeMeshRequest(int &version, MeshRequest &request)
+{
+    std::array<SharedChunk, 27> neighbors;
+
+    std::lock_guard<std::mutex> lock(mMeshMutex);
+    for (auto i = 0; i < 27; ++i)
+        neighbors[i] = mMeshNeighbors[i].lock();
+    mMeshNeighbors = {};
+    mMeshRequested = false;
+    version = mMeshVersion;
+    request = mMeshRequest;
+
+    return neighbors;
+}
+
+bool Chunk::finishMeshJob()
+{
+    std::lock_guard<std::mutex> lock(mMeshMutex);
+    mMeshJobActive = mMeshRequested;
+    return mMeshJobActive;
+}
+
+bool Chunk::hasMeshJob()
+{
+    std::lock_guard<std::mutex> lock(mMeshMutex);
+    return mMeshJobActive;
+}
+
+void Chunk::cancelMeshRequest()
+{
+    std::lock_guard<std::mutex> lock(mMeshMutex);
+    mMeshNeighbors = {};
+    mMeshVersion++;
+}
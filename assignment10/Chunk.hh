@@ -1,6 +1,10 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <glm/glm.hpp>
@@ -8,12 +12,28 @@
 #include <glow/fwd.hh>
 
 #include "Block.hh"
+#include "BlockStorage.hh"
 #include "Constants.hh"
 #include "TerrainMesh.hh"
 
 GLOW_SHARED(class, Chunk);
 class World;
 
+/// occlusion culling state of a chunk (owned by the renderer, see Assignment10)
+/// hardware queries are issued in the depth pre-pass, results are read in a later frame (never stalls)
+struct ChunkOcclusion
+{
+    glow::SharedOcclusionQuery query; ///< created on first use (main thread)
+    bool pending = false;             ///< issued, result not read yet
+    bool visible = true;              ///< last known result
+    int testFrame = -1;               ///< last frame in which the chunk passed frustum and range culling
+
+    /// software occlusion
+    /// culling tasks test each chunk once per frame, concurrent tests store the same result
+    std::atomic<int> softwareFrame{-1}; ///< last frame in which the chunk was tested (release)
+    std::atomic<bool> softwareOccluded{false};
+};
+
 /// chunk size in x,y,z dir (i.e. number of blocks per side)
 /// each block is 1m x 1m x 1m
 /// size is stored in CHUNK_SIZE
@@ -41,9 +61,23 @@ public: // properties
     /// true iff chunk is fully generated
     bool isGenerated() const { return mIsGenerated; }
 
+    /// true iff the blocks differ from the saved version (see World::saveChunks)
+    bool isModified() const { return mIsModified; }
+
+    /// true iff all blocks of this chunk are the same
+    /// (always up-to-date, such chunks have no block array)
+    bool isUniform() const { return mBlocks.isUniform(); }
+    /// the block of a uniform chunk (only valid if isUniform())
+    Block uniformBlock() const { return mBlocks.uniformBlock(); }
+
     /// returns mesh version nr
     int getMeshVersion() const { return mMeshVersion; }
 
+    /// level of detail of the current meshes (0 is full resolution)
+    int getMeshLod() const { return mMeshLod; }
+    /// level of detail requested by the renderer (see World::requestLod)
+    int getDesiredLod() const { return mDesiredLod; }
+
     /// Bounding box
     glm::vec3 getAabbMin() const { return mAabbMin; }
     glm::vec3 getAabbMax() const { return mAabbMax; }
@@ -52,15 +86,39 @@ public: // properties
     glm::vec3 chunkCenter() const { return glm::vec3(chunkPos) + CHUNK_SIZE / 2.0f; }
 
 private: // private members
-    /// List of blocks
+    /// Palette-compressed blocks
     /// Use block(...) functions!
-    std::vector<Block> mBlocks;
+    /// Only modified by the main thread, which locks mBlocksMutex while doing so
+    /// (worker threads lock it while reading)
+    BlockStorage mBlocks;
+    mutable std::mutex mBlocksMutex;
+
+    /// pending mesh request (guarded by mMeshMutex)
+    /// at most one mesh job per chunk is queued or running (until its result is applied),
+    /// it takes its snapshot of the 3x3x3 neighborhood when it starts
+    /// (results arrive in order, so partial updates always apply to the meshes they were built against)
+    std::mutex mMeshMutex;
+    bool mMeshJobActive = false;
+    bool mMeshRequested = false;
+    MeshRequest mMeshRequest;
+    /// neighborhood for the pending mesh job (index 13 is the chunk itself, empty if cancelled)
+    std::array<std::weak_ptr<Chunk>, 27> mMeshNeighbors;
 
     /// This chunk's configured meshes
     std::vector<TerrainMesh> mMeshes;
 
+    /// occlusion culling state (its query is released together with the meshes)
+    ChunkOcclusion mOcclusion;
+
     /// if true, the list of blocks has changed and the mesh might be invalid
     bool mIsDirty = false; //< on cpu side (updated every frame)
+    /// sections that changed since the last update
+    SectionMask mDirtySections = 0;
+
+    /// true iff blocks of this chunk were edited (its meshes are built editable from then on)
+    bool mIsEdited = false;
+    /// true iff the displayed meshes support partial updates
+    bool mMeshesEditable = false;
 
     /// true iff the chunk is solid-only
     bool mIsFullySolid = false;
@@ -70,8 +128,22 @@ private: // private members
     /// true iff chunk is generated
     bool mIsGenerated = false;
 
+    /// true iff the chunk needs to be written to its region file
+    bool mIsModified = false;
+
+    /// last frame in which this chunk was within render distance (for LRU eviction)
+    int mLastUsedFrame = 0;
+
     /// versioning of the mesh (is incremented whenever a mesh update is triggered)
-    int mMeshVersion = 0;
+    /// (read by worker threads)
+    std::atomic<int> mMeshVersion{0};
+    /// version of the currently displayed mesh
+    /// (results of the worker pool can arrive out of order)
+    int mDisplayedMeshVersion = 0;
+
+    /// level of detail of the displayed meshes and the requested one (main thread only)
+    int mMeshLod = 0;
+    int mDesiredLod = 0;
 
     /// bounding box
     glm::vec3 mAabbMin;
@@ -80,6 +152,11 @@ private: // private members
     /// list of blocks that spawn light sources
     std::vector<glm::ivec3> mActiveLightFountains;
 
+private: // helper
+    /// rescans the blocks of some sections after edits
+    /// (flags are only cleared, the bounding box already covers the whole chunk)
+    void updateSections(SectionMask sections);
+
 private: // ctor
     Chunk(glm::ivec3 chunkPos, World* world);
 
@@ -97,23 +174,65 @@ public: // gfx
     /// there is one or more meshes for each material
     std::vector<TerrainMesh> const& queryMeshes();
 
+    /// occlusion culling state of the renderer
+    ChunkOcclusion& occlusion() { return mOcclusion; }
+
 public: // modification funcs
-    /// Marks this chunk as "dirty" (triggers rebuild of mesh)
-    void markDirty();
+    /// Marks sections of this chunk as "dirty" (triggers rebuild of their mesh parts)
+    void markDirty(SectionMask sections = allSections);
 
     /// Updates cpu part of the chunk
+    /// (only the dirty sections are rescanned after block edits)
     void update();
 
-    /// Replaces current mesh data by new one
-    void notifyMeshData(const std::vector<TerrainMeshData>& meshData);
+    /// Replaces the meshes of the given sections by new data
+    /// Partial updates rewrite the sections in place and return false if they do not fit
+    /// (the meshes are unchanged in that case and need a complete rebuild)
+    bool notifyMeshData(const std::vector<TerrainMeshData>& meshData, SectionMask sections = allSections);
+
+public: // mesh requests (thread-safe)
+    /// records a mesh request for a given neighborhood and bumps the mesh version
+    /// (sections of consecutive requests accumulate, other parameters are replaced)
+    /// returns true iff no job is active (i.e. a new mesh job has to be enqueued)
+    bool requestMesh(std::array<std::weak_ptr<Chunk>, 27> const& neighbors, MeshRequest const& request);
+    /// takes the pending mesh request (called when the mesh job starts)
+    /// returns the neighborhood (index 13 is null if cancelled), the current mesh version and the request
+    std::array<SharedChunk, 27> takeMeshRequest(int& version, MeshRequest& request);
+    /// ends the active mesh job (called after its result was applied or dropped)
+    /// returns true iff another request arrived in the meantime (i.e. the next mesh job has to be enqueued)
+    bool finishMeshJob();
+    /// true iff a mesh job is queued or running
+    bool hasMeshJob();
+    /// cancels the pending mesh request and outdates running mesh jobs
+    void cancelMeshRequest();
 
 public: // accessor functions
     /// relative coordinates 0..size-1
     /// do not call outside that range
-    Block& block(glm::ivec3 relPos) { return mBlocks[(relPos.z * CHUNK_SIZE + relPos.y) * CHUNK_SIZE + relPos.x]; }
-    Block const& block(glm::ivec3 relPos) const
+    Block block(glm::ivec3 relPos) const { return mBlocks.get(blockIndex(relPos)); }
+    /// relative coordinates 0..size-1
+    /// does NOT mark the chunk dirty
+    void setBlock(glm::ivec3 relPos, Block b)
+    {
+        std::lock_guard<std::mutex> lock(mBlocksMutex);
+        mBlocks.set(blockIndex(relPos), b);
+    }
+
+    /// decodes `count` blocks in x direction starting at relPos into `out`
+    void copyBlocks(glm::ivec3 relPos, int count, Block* out) const { mBlocks.copyRange(blockIndex(relPos), count, out); }
+
+    /// linear index of a relative position
+    static int blockIndex(glm::ivec3 relPos) { return (relPos.z * CHUNK_SIZE + relPos.y) * CHUNK_SIZE + relPos.x; }
+
+    /// number of bytes used for block storage
+    size_t blockMemoryBytes() const { return mBlocks.memoryBytes(); }
+    /// number of bytes used for mesh buffers on the GPU
+    size_t meshMemoryBytes() const
     {
-        return mBlocks[(relPos.z * CHUNK_SIZE + relPos.y) * CHUNK_SIZE + relPos.x];
+        size_t bytes = 0;
+        for (auto const& m : mMeshes)
+            bytes += m.gpuBytes;
+        return bytes;
     }
 
     /// returns true iff these global coordinates are contained in this block
@@ -126,7 +245,7 @@ public: // accessor functions
 
     /// queries a block in global coordinates
     /// will first search locally and otherwise consult world
-    Block const& queryBlock(glm::ivec3 worldPos) const;
+    Block queryBlock(glm::ivec3 worldPos) const;
 
     /// returns a list of all materials in this chunk
     /// may contain nullptr for air!
@@ -0,0 +1,96 @@
+#include "ChunkMap.hh"
+
+#include <cassert>
+
+SharedChunk& ChunkMap::operator[](glm::ivec3 key)
+{
+    // keep load factor below 0.7
+    if ((mSize + 1) * 10 > mSlots.size() * 7)
+        rehash(mSlots.empty() ? 64 : mSlots.size() * 2);
+
+    auto i = hash(key) & mMask;
+    while (true)
+    {
+        auto& s = mSlots[i];
+        if (s.second == nullptr)
+        {
+            // new entry
+            // NOTE: caller is expected to assign a non-null chunk
+            s.first = key;
+            ++mSize;
+            return s.second;
+        }
+        if (s.first == key)
+            return s.second;
+        i = (i + 1) & mMask;
+    }
+}
+
+bool ChunkMap::erase(glm::ivec3 key)
+{
+    auto idx = findSlot(key);
+    if (idx < 0)
+        return false;
+
+    // backward-shift deletion (keeps probe sequences intact without tombstones)
+    auto hole = size_t(idx);
+    auto i = hole;
+    while (true)
+    {
+        i = (i + 1) & mMask;
+        auto& s = mSlots[i];
+        if (s.second == nullptr)
+            break;
+
+        // entry may only move back if its home slot is not in (hole, i]
+        auto home = hash(s.first) & mMask;
+        auto distHome = (i - home) & mMask;
+        auto distHole = (i - hole) & mMask;
+        if (distHome >= distHole)
+        {
+            mSlots[hole] = std::move(s);
+            hole = i;
+        }
+    }
+
+    mSlots[hole].second = nullptr;
+    --mSize;
+    return true;
+}
+
+void ChunkMap::clear()
+{
+    for (auto& s : mSlots)
+        s.second = nullptr;
+    mSize = 0;
+}
+
+void ChunkMap::reserve(size_t count)
+{
+    auto slots = size_t(64);
+    while (count * 10 > slots * 7)
+        slots *= 2;
+
+    if (slots > mSlots.size())
+        rehash(slots);
+}
+
+void ChunkMap::rehash(size_t newSlotCount)
+{
+    assert((newSlotCount & (newSlotCount - 1)) == 0 && "must be power of two");
+
+    std::vector<value_type> oldSlots(newSlotCount);
+    std::swap(oldSlots, mSlots);
+    mMask = newSlotCount - 1;
+
+    for (auto& s : oldSlots)
+    {
+        if (s.second == nullptr)
+            continue;
+
+        auto i = hash(s.first) & mMask;
+        while (mSlots[i].second != nullptr)
+            i = (i + 1) & mMask;
+        mSlots[i] = std::move(s);
+    }
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <glow/common/shared.hh>
+
+#include "Constants.hh"
+
+GLOW_SHARED(class, Chunk);
+
+/// Open-addressing hash map from chunk position to chunk
+///
+/// All entries live in one flat array (linear probing), so a lookup is
+/// usually a single cache miss instead of a bucket + node pointer chase.
+/// Keys must be chunk positions (multiples of CHUNK_SIZE).
+///
+/// Interface mirrors the subset of std::unordered_map that is used for the world
+/// (iteration yields std::pair<glm::ivec3, SharedChunk> with .first / .second)
+class ChunkMap
+{
+public:
+    using value_type = std::pair<glm::ivec3, SharedChunk>;
+
+    template <typename T>
+    struct Iterator
+    {
+        T* slot;
+        T* end;
+
+        Iterator(T* slot, T* end) : slot(slot), end(end) { skipEmpty(); }
+
+        T& operator*() const { return *slot; }
+        T* operator->() const { return slot; }
+
+        Iterator& operator++()
+        {
+            ++slot;
+            skipEmpty();
+            return *this;
+        }
+
+        bool operator==(Iterator const& rhs) const { return slot == rhs.slot; }
+        bool operator!=(Iterator const& rhs) const { return slot != rhs.slot; }
+
+    private:
+        void skipEmpty()
+        {
+            while (slot != end && slot->second == nullptr)
+                ++slot;
+        }
+    };
+
+    using iterator = Iterator<value_type>;
+    using const_iterator = Iterator<value_type const>;
+
+private:
+    /// slots, empty iff .second == nullptr
+    std::vector<value_type> mSlots;
+
+    /// number of occupied slots
+    size_t mSize = 0;
+
+    /// mSlots.size() - 1 (size is always a power of two)
+    size_t mMask = 0;
+
+public: // properties
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+
+    /// number of slots (occupied or not)
+    size_t capacity() const { return mSlots.size(); }
+
+public: // iteration
+    iterator begin() { return {mSlots.data(), mSlots.data() + mSlots.size()}; }
+    iterator end() { return {mSlots.data() + mSlots.size(), mSlots.data() + mSlots.size()}; }
+    const_iterator begin() const { return {mSlots.data(), mSlots.data() + mSlots.size()}; }
+    const_iterator end() const { return {mSlots.data() + mSlots.size(), mSlots.data() + mSlots.size()}; }
+
+public: // lookup
+    iterator find(glm::ivec3 key)
+    {
+        auto i = findSlot(key);
+        return i < 0 ? end() : iterator(mSlots.data() + i, mSlots.data() + mSlots.size());
+    }
+    const_iterator find(glm::ivec3 key) const
+    {
+        auto i = findSlot(key);
+        return i < 0 ? end() : const_iterator(mSlots.data() + i, mSlots.data() + mSlots.size());
+    }
+
+    size_t count(glm::ivec3 key) const { return findSlot(key) < 0 ? 0 : 1; }
+
+    /// returns the chunk for a key (nullptr if not found)
+    Chunk* get(glm::ivec3 key) const
+    {
+        auto i = findSlot(key);
+        return i < 0 ? nullptr : mSlots[i].second.get();
+    }
+
+public: // modification
+    /// returns a reference to the chunk for a key
+    /// NOTE: assigning nullptr is not allowed (use erase)
+    SharedChunk& operator[](glm::ivec3 key);
+
+    /// removes a key, returns true if it was present
+    bool erase(glm::ivec3 key);
+
+    /// removes all entries
+    void clear();
+
+    /// reserves slots for at least `count` entries
+    void reserve(size_t count);
+
+public: // hashing
+    /// bit-mixed hash of a chunk position
+    static uint32_t hash(glm::ivec3 key)
+    {
+        // chunk positions are multiples of CHUNK_SIZE
+        auto x = uint64_t(uint32_t(key.x / CHUNK_SIZE));
+        auto y = uint64_t(uint32_t(key.y / CHUNK_SIZE));
+        auto z = uint64_t(uint32_t(key.z / CHUNK_SIZE));
+
+        // multiply-xorshift mixing (all input bits affect the upper result bits)
+        auto h = x * 0x9E3779B97F4A7C15ull ^ y * 0xC2B2AE3D27D4EB4Full ^ z * 0x165667B19E3779F9ull;
+        h ^= h >> 29;
+        h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 32;
+        return uint32_t(h);
+    }
+
+private: // helper
+    /// returns the slot index of a key (-1 if not found)
+    int64_t findSlot(glm::ivec3 key) const
+    {
+        if (mSlots.empty())
+            return -1;
+
+        auto i = hash(key) & mMask;
+        while (true)
+        {
+            auto const& s = mSlots[i];
+            if (s.second == nullptr)
+                return -1;
+            if (s.first == key)
+                return i;
+            i = (i + 1) & mMask;
+        }
+    }
+
+    /// re-inserts all entries into `newSlotCount` slots
+    void rehash(size_t newSlotCount);
+};
@@ -3,3 +3,12 @@
 #define CHUNK_SIZE 32
 
 #define SHADOW_CASCADES 3
+
+/// number of mesh detail levels (level l uses cells of 2^l blocks per side)
+#define LOD_LEVELS 4
+
+/// chunks are split into sections of SECTION_SIZE^3 blocks for incremental re-meshing
+/// (one bit per section in a 64 bit mask, see SectionMask)
+#define SECTION_SIZE 8
+#define SECTIONS_PER_SIDE (CHUNK_SIZE / SECTION_SIZE)
+#define SECTION_COUNT (SECTIONS_PER_SIDE * SECTIONS_PER_SIDE * SECTIONS_PER_SIDE)
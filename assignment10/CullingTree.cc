@@ -0,0 +1,133 @@
+#include "CullingTree.hh"
+
+#include <algorithm>
+#include <numeric>
+
+namespace
+{
+/// spreads the lower 16 bit to the even bits
+uint32_t spreadBits(uint32_t v)
+{
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+}
+
+void CullingTree::build(std::vector<Item> const& items)
+{
+    mNodes.clear();
+    mItems.clear();
+    mCodes.clear();
+    for (auto& b : mItemBounds)
+        b.clear();
+    mItemIds.clear();
+
+    if (items.empty())
+        return;
+
+    // Morton codes of the columns (coordinates relative to 2^15 columns)
+    std::vector<uint32_t> codes(items.size());
+    for (auto i = 0u; i < items.size(); ++i)
+    {
+        auto center = (items[i].aabbMin + items[i].aabbMax) / 2.0f;
+        auto x = uint32_t(int(glm::floor(center.x / columnSize)) + (1 << 15));
+        auto z = uint32_t(int(glm::floor(center.z / columnSize)) + (1 << 15));
+        codes[i] = spreadBits(x) | (spreadBits(z) << 1);
+    }
+
+    // sort items by code
+    std::vector<int> order(items.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return codes[a] < codes[b]; });
+
+    mItems.reserve(items.size());
+    mCodes.reserve(items.size());
+    for (auto i : order)
+    {
+        mItems.push_back(items[i]);
+        mCodes.push_back(codes[i]);
+    }
+
+    // structure-of-arrays copy for batched tests
+    for (auto a = 0; a < 3; ++a)
+    {
+        mItemBounds[a].reserve(mItems.size() + FrustumCuller::batchSize);
+        mItemBounds[a + 3].reserve(mItems.size() + FrustumCuller::batchSize);
+        for (auto const& item : mItems)
+        {
+            mItemBounds[a].push_back(item.aabbMin[a]);
+            mItemBounds[a + 3].push_back(item.aabbMax[a]);
+        }
+    }
+    for (auto const& item : mItems)
+        mItemIds.push_back(item.id);
+    for (auto& b : mItemBounds)
+        b.resize(mItems.size() + FrustumCuller::batchSize, 0.0f);
+
+    mNodes.push_back({});
+    buildNode(0, 0, (int)mItems.size());
+}
+
+void CullingTree::buildNode(int nodeIdx, int begin, int end)
+{
+    auto firstCode = mCodes[begin];
+    auto lastCode = mCodes[end - 1];
+
+    // single column: leaf
+    if (firstCode == lastCode)
+    {
+        auto amin = mItems[begin].aabbMin;
+        auto amax = mItems[begin].aabbMax;
+        for (auto i = begin + 1; i < end; ++i)
+        {
+            amin = min(amin, mItems[i].aabbMin);
+            amax = max(amax, mItems[i].aabbMax);
+        }
+
+        mNodes[nodeIdx] = {amin, amax, begin, end - begin, true, 0};
+        return;
+    }
+
+    // split at the highest differing quadtree level (2 bits per level)
+    auto level = 15;
+    while (((firstCode ^ lastCode) >> (2 * level)) == 0)
+        --level;
+
+    // children are the non-empty quadrants (contiguous, items are sorted)
+    int bounds[5];
+    bounds[0] = begin;
+    bounds[4] = end;
+    for (auto q = 1; q < 4; ++q)
+    {
+        auto parentBits = level == 15 ? 0u : firstCode >> (2 * level + 2) << (2 * level + 2);
+        auto prefix = parentBits | uint32_t(q) << (2 * level);
+        bounds[q] = int(std::lower_bound(mCodes.begin() + begin, mCodes.begin() + end, prefix) - mCodes.begin());
+    }
+
+    auto firstChild = (int)mNodes.size();
+    auto childCount = 0;
+    for (auto q = 0; q < 4; ++q)
+        if (bounds[q] < bounds[q + 1])
+            ++childCount;
+    mNodes.resize(mNodes.size() + childCount);
+
+    auto child = firstChild;
+    for (auto q = 0; q < 4; ++q)
+        if (bounds[q] < bounds[q + 1])
+            buildNode(child++, bounds[q], bounds[q + 1]);
+
+    // bounds of all children
+    auto amin = mNodes[firstChild].aabbMin;
+    auto amax = mNodes[firstChild].aabbMax;
+    for (auto i = firstChild + 1; i < firstChild + childCount; ++i)
+    {
+        amin = min(amin, mNodes[i].aabbMin);
+        amax = max(amax, mNodes[i].aabbMax);
+    }
+
+    mNodes[nodeIdx] = {amin, amax, firstChild, childCount, false, 0};
+}
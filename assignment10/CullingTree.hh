@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "FrustumCuller.hh"
+
+/**
+ * @brief Quadtree over chunk columns for hierarchical frustum and range culling
+ *
+ * Leaves hold the items (e.g. meshes) of one chunk column, inner nodes up to four children.
+ * Every node stores the bounds of all its items, including their min/max height.
+ * Nodes with a single child are skipped, so the depth is logarithmic in the extent of the world.
+ *
+ * The tree is rebuilt from scratch when the items change (see build).
+ * Queries only descend into nodes that intersect the frustum and the render range
+ * and pass down the planes (and range test) that children still have to check.
+ * Nodes remember the plane that culled them and test it first in the next query (plane coherency).
+ * The items of a leaf are tested in SIMD batches (see FrustumCuller::visibleMask).
+ */
+class CullingTree
+{
+public:
+    struct Item
+    {
+        glm::vec3 aabbMin;
+        glm::vec3 aabbMax;
+        int id; ///< user data, reported by query
+    };
+
+private:
+    struct Node
+    {
+        glm::vec3 aabbMin;
+        glm::vec3 aabbMax;
+        int first; ///< first child (inner node) or first item (leaf)
+        int count; ///< number of children or items
+        bool leaf;
+        mutable int cullingPlane; ///< plane that culled the node in the last query
+    };
+
+    /// root is node 0, children of a node are stored consecutively
+    std::vector<Node> mNodes;
+    /// items sorted by the Morton code of their column
+    std::vector<Item> mItems;
+    std::vector<uint32_t> mCodes;
+
+    /// item bounds in structure-of-arrays layout (min x, y, z, max x, y, z) and ids, same order as mItems
+    /// (padded by a batch, so the last batch of a leaf can always be loaded)
+    std::vector<float> mItemBounds[6];
+    std::vector<int> mItemIds;
+
+public:
+    /// size of a column in x and z
+    float const columnSize;
+
+    explicit CullingTree(float columnSize) : columnSize(columnSize) {}
+
+    /// rebuilds the tree for the given items (columns are derived from the item centers)
+    void build(std::vector<Item> const& items);
+
+    /// calls f(id) for all items that intersect the frustum (if `frustum` is true)
+    /// and are within `renderDistance` (if non-negative), in no particular order
+    /// (updates the plane coherency of the nodes, so a tree must not be queried by several threads at once)
+    template <class F>
+    void query(FrustumCuller const& culler, bool frustum, float renderDistance, F&& f) const;
+
+private:
+    /// builds the node for the items [begin, end) into mNodes[nodeIdx]
+    void buildNode(int nodeIdx, int begin, int end);
+};
+
+template <class F>
+void CullingTree::query(FrustumCuller const& culler, bool frustum, float renderDistance, F&& f) const
+{
+    if (mNodes.empty())
+        return;
+
+    // returns false if culled, otherwise removes tests that are passed by all children
+    auto isVisible = [&](Node const& node, int& planeMask, bool& checkRange) {
+        auto const& amin = node.aabbMin;
+        auto const& amax = node.aabbMax;
+        if (planeMask && !culler.isAabbVisible(amin, amax, planeMask, &node.cullingPlane))
+            return false;
+
+        if (checkRange)
+        {
+            if (!culler.isAabbInRange(amin, amax, renderDistance))
+                return false;
+            if (culler.isAabbFullyInRange(amin, amax, renderDistance))
+                checkRange = false;
+        }
+
+        return true;
+    };
+
+    struct Entry
+    {
+        int node;
+        int planeMask;
+        bool checkRange;
+    };
+
+    // depth-first (at most 3 pending siblings per level, 16 levels for 32 bit codes)
+    Entry stack[64];
+    auto stackSize = 0;
+    stack[stackSize++] = {0, frustum ? culler.allPlanes() : 0, renderDistance >= 0};
+
+    while (stackSize > 0)
+    {
+        auto e = stack[--stackSize];
+        auto const& node = mNodes[e.node];
+
+        if (!isVisible(node, e.planeMask, e.checkRange))
+            continue;
+
+        if (node.leaf)
+        {
+            // batches of items (surplus items of the last batch are masked out)
+            auto end = node.first + node.count;
+            for (auto i = node.first; i < end; i += FrustumCuller::batchSize)
+            {
+                float const* bounds[6];
+                for (auto a = 0; a < 6; ++a)
+                    bounds[a] = mItemBounds[a].data() + i;
+
+                auto mask = culler.visibleMask(bounds, e.planeMask, e.checkRange ? renderDistance : -1.0f);
+                if (end - i < FrustumCuller::batchSize)
+                    mask &= (1 << (end - i)) - 1;
+
+                for (; mask; mask &= mask - 1)
+                {
+                    auto b = 0;
+                    while (!(mask & (1 << b)))
+                        ++b;
+                    f(mItemIds[i + b]);
+                }
+            }
+        }
+        else
+        {
+            for (auto i = node.first; i < node.first + node.count; ++i)
+            {
+                assert(stackSize < 64);
+                stack[stackSize++] = {i, e.planeMask, e.checkRange};
+            }
+        }
+    }
+}
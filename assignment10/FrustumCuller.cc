@@ -1,3 +1,164 @@
 #include "FrustumCuller.hh"
 
+#include <cassert>
 
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+void FrustumCuller::addCasterVolume(std::array<glm::vec3, 8> const& corners, glm::vec3 toLight, float margin)
+{
+    // faces as corner indices (bit 0: x, bit 1: y, bit 2: far), order near, far, -x, +x, -y, +y
+    static int const faces[6][4] = {
+        {0, 1, 3, 2}, //
+        {4, 6, 7, 5}, //
+        {0, 2, 6, 4}, //
+        {1, 5, 7, 3}, //
+        {0, 4, 5, 1}, //
+        {2, 3, 7, 6}, //
+    };
+
+    auto centroid = glm::vec3(0.0f);
+    for (auto const& c : corners)
+        centroid += c / 8.0f;
+
+    // plane through a point with its normal facing away from the centroid
+    auto outwardPlane = [&](glm::vec3 n, glm::vec3 p) {
+        n = normalize(n);
+        if (dot(n, p - centroid) < 0)
+            n = -n;
+        return glm::vec4(n, dot(n, p) + margin);
+    };
+
+    glm::vec4 facePlanes[6];
+    for (auto f = 0; f < 6; ++f)
+    {
+        auto const& p0 = corners[faces[f][0]];
+        auto const& p1 = corners[faces[f][1]];
+        auto const& p3 = corners[faces[f][3]];
+        facePlanes[f] = outwardPlane(cross(p1 - p0, p3 - p0), p0);
+    }
+
+    auto facesLight = [&](int f) { return dot(glm::vec3(facePlanes[f]), toLight) > 0; };
+
+    for (auto f = 0; f < 6; ++f)
+    {
+        // faces away from the light also bound the extruded volume
+        if (!facesLight(f))
+        {
+            assert(planeCount < maxPlanes);
+            planes[planeCount++] = facePlanes[f];
+            continue;
+        }
+
+        // silhouette edges (between a face towards and a face away from the light) are extruded
+        for (auto e = 0; e < 4; ++e)
+        {
+            auto a = faces[f][e];
+            auto b = faces[f][(e + 1) % 4];
+            for (auto g = 0; g < 6; ++g)
+            {
+                if (g == f || facesLight(g))
+                    continue;
+
+                auto hasA = false, hasB = false;
+                for (auto i = 0; i < 4; ++i)
+                {
+                    hasA |= faces[g][i] == a;
+                    hasB |= faces[g][i] == b;
+                }
+
+                // (an edge parallel to the light adds no plane, which is conservative)
+                auto n = cross(corners[b] - corners[a], toLight);
+                if (hasA && hasB && dot(n, n) > 1e-12f)
+                {
+                    assert(planeCount < maxPlanes);
+                    planes[planeCount++] = outwardPlane(n, corners[a]);
+                }
+            }
+        }
+    }
+}
+
+int FrustumCuller::visibleMask(float const* const bounds[6], int planeMask, float renderDistance) const
+{
+    // per plane, the corner closest to the inside is the same for all boxes:
+    // min or max bounds are picked by the sign of the normal (no per-box selection needed)
+#if defined(__AVX__)
+    auto visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (auto i = 0; i < planeCount; ++i)
+    {
+        if (!(planeMask & (1 << i)))
+            continue;
+
+        auto const& p = planes[i];
+        auto x = _mm256_loadu_ps(bounds[p.x > 0 ? 0 : 3]);
+        auto y = _mm256_loadu_ps(bounds[p.y > 0 ? 1 : 4]);
+        auto z = _mm256_loadu_ps(bounds[p.z > 0 ? 2 : 5]);
+        auto dis = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(p.x)), _mm256_mul_ps(y, _mm256_set1_ps(p.y))),
+                                 _mm256_mul_ps(z, _mm256_set1_ps(p.z)));
+        visible = _mm256_andnot_ps(_mm256_cmp_ps(dis, _mm256_set1_ps(p.w), _CMP_GT_OQ), visible);
+    }
+
+    if (renderDistance >= 0)
+    {
+        // distance to the closest point of the box
+        auto closestDelta = [&](int a, float c) {
+            auto v = _mm256_set1_ps(c);
+            auto closest = _mm256_min_ps(_mm256_max_ps(v, _mm256_loadu_ps(bounds[a])), _mm256_loadu_ps(bounds[a + 3]));
+            auto d = _mm256_sub_ps(closest, v);
+            return _mm256_mul_ps(d, d);
+        };
+        auto dis2 = _mm256_add_ps(_mm256_add_ps(closestDelta(0, camPos.x), closestDelta(1, camPos.y)), closestDelta(2, camPos.z));
+        visible = _mm256_and_ps(_mm256_cmp_ps(dis2, _mm256_set1_ps(renderDistance * renderDistance), _CMP_LE_OQ), visible);
+    }
+
+    return _mm256_movemask_ps(visible);
+#elif defined(__SSE__)
+    auto visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (auto i = 0; i < planeCount; ++i)
+    {
+        if (!(planeMask & (1 << i)))
+            continue;
+
+        auto const& p = planes[i];
+        auto x = _mm_loadu_ps(bounds[p.x > 0 ? 0 : 3]);
+        auto y = _mm_loadu_ps(bounds[p.y > 0 ? 1 : 4]);
+        auto z = _mm_loadu_ps(bounds[p.z > 0 ? 2 : 5]);
+        auto dis = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(p.x)), _mm_mul_ps(y, _mm_set1_ps(p.y))),
+                              _mm_mul_ps(z, _mm_set1_ps(p.z)));
+        visible = _mm_andnot_ps(_mm_cmpgt_ps(dis, _mm_set1_ps(p.w)), visible);
+    }
+
+    if (renderDistance >= 0)
+    {
+        // distance to the closest point of the box
+        auto closestDelta = [&](int a, float c) {
+            auto v = _mm_set1_ps(c);
+            auto closest = _mm_min_ps(_mm_max_ps(v, _mm_loadu_ps(bounds[a])), _mm_loadu_ps(bounds[a + 3]));
+            auto d = _mm_sub_ps(closest, v);
+            return _mm_mul_ps(d, d);
+        };
+        auto dis2 = _mm_add_ps(_mm_add_ps(closestDelta(0, camPos.x), closestDelta(1, camPos.y)), closestDelta(2, camPos.z));
+        visible = _mm_and_ps(_mm_cmple_ps(dis2, _mm_set1_ps(renderDistance * renderDistance)), visible);
+    }
+
+    return _mm_movemask_ps(visible);
+#else
+    auto mask = 0;
+    for (auto b = 0; b < batchSize; ++b)
+    {
+        glm::vec3 amin(bounds[0][b], bounds[1][b], bounds[2][b]);
+        glm::vec3 amax(bounds[3][b], bounds[4][b], bounds[5][b]);
+
+        auto boxMask = planeMask;
+        if (boxMask && !isAabbVisible(amin, amax, boxMask))
+            continue;
+        if (renderDistance >= 0 && !isAabbInRange(amin, amax, renderDistance))
+            continue;
+
+        mask |= 1 << b;
+    }
+    return mask;
+#endif
+}
@@ -8,8 +8,20 @@
 
 struct FrustumCuller
 {
+    /// number of boxes tested by visibleMask (one SIMD register)
+#if defined(__AVX__)
+    static const int batchSize = 8;
+#else
+    static const int batchSize = 4;
+#endif
+
+    /// frustum planes plus up to 18 planes of a shadow caster volume (see addCasterVolume)
+    static const int maxPlanes = 24;
+
 private:
-    std::array<glm::vec4, 6> planes;
+    /// normals point outwards, a point p is outside iff dot(p, n) > w
+    std::array<glm::vec4, maxPlanes> planes;
+    int planeCount = 6;
     glm::vec3 camPos;
     bool isShadow;
 
@@ -61,20 +73,64 @@ public:
 
     bool isAabbVisible(glm::vec3 amin, glm::vec3 amax) const
     {
-        auto center = (amin + amax) / 2.0f;
-        auto radius = distance(amax, center);
+        auto planeMask = allPlanes();
+        return isAabbVisible(amin, amax, planeMask);
+    }
+
+    /// viewing direction (normal of the near plane)
+    glm::vec3 forward() const { return -glm::vec3(planes[0]); }
+
+    /// mask of all planes (for hierarchical tests)
+    int allPlanes() const { return (1 << planeCount) - 1; }
+
+    /// restricts a shadow frustum to the casters of a part of the camera frustum
+    /// `corners` is a convex hexahedron (index bits: x, y, near/far), `toLight` points towards the light
+    /// adds the planes of the hexahedron extruded towards the light (other casters cannot shadow it),
+    /// moved outwards by `margin`
+    void addCasterVolume(std::array<glm::vec3, 8> const& corners, glm::vec3 toLight, float margin);
 
-        for (auto i = 0; i < 6; ++i)
+    /// hierarchical box test against the planes whose bit is set in `planeMask`
+    /// returns false if the box is outside, otherwise clears the bits of all planes the box is completely inside of
+    /// (children of the box only need to be tested against the remaining planes)
+    /// plane coherency: if `cullingPlane` is given, that plane is tested first
+    /// and set to the plane that culled the box (boxes tend to be culled by the same plane as in the last frame)
+    bool isAabbVisible(glm::vec3 amin, glm::vec3 amax, int& planeMask, int* cullingPlane = nullptr) const
+    {
+        auto first = cullingPlane ? *cullingPlane : 0;
+        for (auto k = 0; k < planeCount; ++k)
         {
+            auto i = (first + k) % planeCount;
+            if (!(planeMask & (1 << i)))
+                continue;
+
+            // corners closest to and farthest from the inside (normals point outwards)
             auto const& p = planes[i];
-            auto dis = dot(center, glm::vec3(p));
-            if (dis - radius > p.w)
-                return false;
+            glm::vec3 closest, farthest;
+            for (auto a = 0; a < 3; ++a)
+            {
+                closest[a] = p[a] > 0 ? amin[a] : amax[a];
+                farthest[a] = p[a] > 0 ? amax[a] : amin[a];
+            }
+
+            if (dot(closest, glm::vec3(p)) > p.w)
+            {
+                if (cullingPlane)
+                    *cullingPlane = i;
+                return false; // completely outside
+            }
+            if (dot(farthest, glm::vec3(p)) <= p.w)
+                planeMask &= ~(1 << i); // completely inside
         }
 
         return true;
     }
 
+    /// exact test of `batchSize` boxes in structure-of-arrays layout against the planes in `planeMask`
+    /// and (if non-negative) the render distance
+    /// `bounds` are 6 arrays (min x, y, z, max x, y, z) of at least `batchSize` floats each
+    /// returns a bit mask of the boxes that are visible (bit i for box i)
+    int visibleMask(float const* const bounds[6], int planeMask, float renderDistance) const;
+
     bool isAabbInRange(glm::vec3 amin, glm::vec3 amax, float renderDistance) const
     {
         auto p = clamp(camPos, amin, amax);
@@ -85,6 +141,13 @@ public:
         return true;
     }
 
+    /// true iff every point of the box is within the render distance
+    bool isAabbFullyInRange(glm::vec3 amin, glm::vec3 amax, float renderDistance) const
+    {
+        auto farthest = max(abs(camPos - amin), abs(camPos - amax));
+        return length(farthest) <= renderDistance;
+    }
+
     bool isFaceVisible(glm::ivec3 dir, glm::vec3 amin, glm::vec3 amax) const
     {
         auto n = glm::vec3(dir);
@@ -1,6 +1,15 @@
 #include "MeshGenerator.hh"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include <glow/common/log.hh>
 #include <glow/common/profiling.hh>
@@ -21,97 +30,451 @@ int randAt(int x, int y, int z, int minInc, int maxInc)
     return glm::clamp((int)(minInc + (maxInc - minInc + 1) * (noise.GetWhiteNoiseInt(x, y, z) * 0.5 + 0.5)), minInc, maxInc);
 }
 
-int aoAt(const std::vector<Block> &blocks, glm::ivec3 pos, glm::ivec3 dx, glm::ivec3 dy)
+/// Occupancy bitmasks of the padded EXT_SIZE^3 block array
+/// One 64 bit row per (y, z), index z * EXT_SIZE + y, bit x is block (x, y, z)
+using BlockRows = std::vector<uint64_t>;
+
+/// Solidity of the 3x3x3 neighborhood of block p
+/// bit (dz + 1) * 9 + (dy + 1) * 3 + (dx + 1) is set iff block p + (dx, dy, dz) is solid
+uint32_t solidNeighborhood(BlockRows const &solidRows, glm::ivec3 p)
 {
-    auto block = [&blocks](glm::ivec3 ip) { return blocks[(ip.z * EXT_SIZE + ip.y) * EXT_SIZE + ip.x]; };
+    uint32_t mask = 0;
+    for (auto dz = 0; dz < 3; ++dz)
+        for (auto dy = 0; dy < 3; ++dy)
+            mask |= uint32_t((solidRows[(p.z + dz - 1) * EXT_SIZE + p.y + dy - 1] >> (p.x - 1)) & 7) << (dz * 9 + dy * 3);
+    return mask;
+}
+
+int countTrailingZeros(uint32_t v)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, v);
+    return (int)idx;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+/// Per-(material, direction) output of the mesher
+struct MeshStream
+{
+    std::vector<uint32_t> positions;
+    std::vector<TerrainVertex> data;
+    std::vector<Plant> plants;
 
-    // block(pos) is non-solid
+    /// section of each quad and plant
+    std::vector<uint8_t> quadSections;
+    std::vector<uint8_t> plantSections;
 
-    // query three relevant materials
-    auto s10 = block(pos + dx).isSolid();
-    auto s01 = block(pos + dy).isSolid();
-    auto s11 = block(pos + dx + dy).isSolid();
+    void clear()
+    {
+        positions.clear();
+        data.clear();
+        plants.clear();
+        quadSections.clear();
+        plantSections.clear();
+    }
+};
+
+/// Scratch memory of the mesher
+/// (one per thread, keeps its capacity across jobs)
+struct MeshScratch
+{
+    BlockRows solidRows;
+    BlockRows nonAirRows;
+    std::vector<uint32_t> faceMasks[6];
+
+    /// greedy meshing: (material index << 16) + face key per block, -1 if no face
+    /// index is the local block index (z * CHUNK_SIZE + y) * CHUNK_SIZE + x
+    /// (all keys are consumed by the merge, so they are -1 again after every job)
+    std::vector<int32_t> faceKeys[6];
 
-    if (s10 && s01)
-        s11 = true; // corner case
+    /// output streams, index is material index * 6 + pdir
+    std::vector<MeshStream> streams;
 
-    return 3 - s10 - s01 - s11;
+    /// downsampled blocks (lod > 0)
+    std::vector<Block> coarseBlocks;
+};
+
+/// Compares 32 consecutive blocks, bit i is set iff a[i] and b[i] have the same material
+uint32_t sameMaterialMask(Block const *a, Block const *b)
+{
+    static_assert(sizeof(Block) == 1, "blocks are compared bytewise");
+
+#if defined(__AVX2__)
+    auto va = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(a));
+    auto vb = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(b));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+#elif defined(__SSE2__)
+    auto lo = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(a)),
+                             _mm_loadu_si128(reinterpret_cast<__m128i const *>(b)));
+    auto hi = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(a + 16)),
+                             _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + 16)));
+    return (uint32_t)_mm_movemask_epi8(lo) | (uint32_t)_mm_movemask_epi8(hi) << 16;
+#else
+    uint32_t mask = 0;
+    for (auto i = 0; i < 32; ++i)
+        mask |= uint32_t(a[i].mat == b[i].mat) << i;
+    return mask;
+#endif
 }
 
-int edgeAt(const std::vector<Block> &blocks, glm::ivec3 pos, glm::ivec3 d, glm::ivec3 n)
+/// Computes visible faces of all materials
+/// A face is visible if the block is not air and the neighbor in face direction is neither solid nor of the same material
+/// Bit x - 1 of faces[pdir][(z - 1) * CHUNK_SIZE + y - 1] is set iff block (x, y, z) has a visible face in direction pdir
+/// (32 blocks at a time with shifts, and-nots and a bytewise material compare)
+/// Only blocks in 1..size are considered (size < CHUNK_SIZE for downsampled blocks)
+/// and only blocks in the given sections (all sections for downsampled blocks)
+/// If skirts is true, faces of solid surface blocks (non-solid above) at the x/z sides are always visible
+void computeFaceMasks(std::vector<Block> const &blocks,
+                      BlockRows const &solidRows,
+                      BlockRows const &nonAirRows,
+                      int size,
+                      SectionMask sections,
+                      bool skirts,
+                      std::vector<uint32_t> (&faces)[6])
 {
-    auto block = [&blocks](glm::ivec3 ip) { return blocks[(ip.z * EXT_SIZE + ip.y) * EXT_SIZE + ip.x]; };
+    static_assert(CHUNK_SIZE == 32, "face masks assume 32 blocks per row");
 
-    auto sTop = block(pos + d).isSolid();
-    auto sBot = block(pos + d - n).isSolid();
+    for (auto &f : faces)
+        f.resize(CHUNK_SIZE * CHUNK_SIZE);
 
-    if (sTop)
-        return 2;
-    else if (sBot)
-        return 1;
-    else
-        return 0;
+    // row offsets of the 6 neighbor directions
+    static const glm::ivec3 dirs[] = {{-1, 0, 0}, {0, -1, 0}, {0, 0, -1}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+
+    auto interior = size == 32 ? ~0u : (1u << size) - 1;
+
+    for (auto z = 1; z <= CHUNK_SIZE; ++z)
+        for (auto y = 1; y <= CHUNK_SIZE; ++y)
+        {
+            auto r = z * EXT_SIZE + y;
+            auto i = (z - 1) * CHUNK_SIZE + y - 1;
+
+            // blocks of this row in the requested sections
+            auto rowMask = interior;
+            if (sections != allSections)
+            {
+                auto first = (((z - 1) / SECTION_SIZE * SECTIONS_PER_SIDE) + (y - 1) / SECTION_SIZE) * SECTIONS_PER_SIDE;
+                rowMask = 0;
+                for (auto sx = 0; sx < SECTIONS_PER_SIDE; ++sx)
+                    if ((sections >> (first + sx)) & 1)
+                        rowMask |= ((1u << SECTION_SIZE) - 1) << (sx * SECTION_SIZE);
+            }
+
+            // bit 0 and 33 are padding
+            auto nonAir = uint32_t(nonAirRows[r] >> 1) & rowMask;
+            if (!nonAir || y > size || z > size)
+            {
+                for (auto &f : faces)
+                    f[i] = 0;
+                continue;
+            }
+
+            auto row = &blocks[r * EXT_SIZE + 1];
+            for (auto pdir = 0; pdir < 6; ++pdir)
+            {
+                auto n = dirs[pdir];
+                auto nr = r + n.z * EXT_SIZE + n.y;
+
+                auto solidN = uint32_t(solidRows[nr] >> (1 + n.x));
+                auto sameN = sameMaterialMask(row, &blocks[nr * EXT_SIZE + 1 + n.x]);
+
+                faces[pdir][i] = nonAir & ~solidN & ~sameN;
+            }
+
+            // skirts: close cracks to neighbors with a different level of detail
+            if (skirts)
+            {
+                auto surface = nonAir & uint32_t(solidRows[r] >> 1) & ~uint32_t(solidRows[r + 1] >> 1);
+
+                faces[0][i] |= surface & 1u;
+                faces[3][i] |= surface & (1u << (size - 1));
+                if (z == 1)
+                    faces[2][i] |= surface;
+                if (z == size)
+                    faces[5][i] |= surface;
+            }
+        }
 }
 
-void buildMeshFor(const std::vector<Block> &blocks,
-                  glm::ivec3 chunkPos,
-                  int mat, //
-                  std::vector<TerrainMeshData> &newMeshes,
-                  World const &world)
+/// Downsamples blocks to cells of cellSize^3 blocks (majority material)
+/// A cell is air if at least half of its blocks are air, ties prefer solid materials
+/// The result uses the same padded layout as the input, cells 1..CHUNK_SIZE / cellSize are interior,
+/// the padding cells are voted from the 1 block padding layer
+void downsampleBlocks(std::vector<Block> const &blocks, int cellSize, std::vector<Block> &coarse)
 {
-    auto block = [&blocks](glm::ivec3 ip) { return blocks[(ip.z * EXT_SIZE + ip.y) * EXT_SIZE + ip.x]; };
+    auto size = CHUNK_SIZE / cellSize;
+    coarse.assign(EXT_SIZE * EXT_SIZE * EXT_SIZE, Block::air());
+
+    // block range of a cell (inclusive)
+    auto rangeOf = [&](int c, int &b0, int &b1) {
+        if (c == 0)
+            b0 = b1 = 0;
+        else if (c == size + 1)
+            b0 = b1 = EXT_SIZE - 1;
+        else
+        {
+            b0 = 1 + (c - 1) * cellSize;
+            b1 = c * cellSize;
+        }
+    };
+
+    int counts[256] = {};
+    std::vector<uint8_t> touched;
+
+    for (auto cz = 0; cz <= size + 1; ++cz)
+        for (auto cy = 0; cy <= size + 1; ++cy)
+            for (auto cx = 0; cx <= size + 1; ++cx)
+            {
+                int x0, x1, y0, y1, z0, z1;
+                rangeOf(cx, x0, x1);
+                rangeOf(cy, y0, y1);
+                rangeOf(cz, z0, z1);
+
+                auto total = 0;
+                auto nonAir = 0;
+                auto bestCount = 0;
+                auto best = Block::air();
+                for (auto z = z0; z <= z1; ++z)
+                    for (auto y = y0; y <= y1; ++y)
+                        for (auto x = x0; x <= x1; ++x)
+                        {
+                            auto b = blocks[(z * EXT_SIZE + y) * EXT_SIZE + x];
+                            ++total;
+                            if (b.isAir())
+                                continue;
+                            ++nonAir;
+
+                            auto &cnt = counts[uint8_t(b.mat)];
+                            if (cnt == 0)
+                                touched.push_back(uint8_t(b.mat));
+                            ++cnt;
+
+                            if (cnt > bestCount || (cnt == bestCount && b.isSolid() && !best.isSolid()))
+                            {
+                                bestCount = cnt;
+                                best = b;
+                            }
+                        }
+
+                for (auto m : touched)
+                    counts[m] = 0;
+                touched.clear();
+
+                if (nonAir * 2 >= total)
+                    coarse[(cz * EXT_SIZE + cy) * EXT_SIZE + cx] = best;
+            }
+}
 
-    // GLOW_ACTION(); // time this method (shown on shutdown)
+/// packs AO and edge values of a face into a single key (0 .. 256 * 81 - 1)
+/// (same layout as the AO and edge part of the vertex flags)
+int faceKey(glm::ivec4 ao, glm::ivec4 edges)
+{
+    return ao.x + 4 * ao.y + 16 * ao.z + 64 * ao.w + 256 * (edges.x + 3 * edges.y + 9 * edges.z + 27 * edges.w);
+}
 
-    auto material = world.getMaterialFromIndex(mat);
+/**
+ * Precomputed AO and edge flags of a face
+ *
+ * Indexed by the solidity of the 12 blocks that influence a face, in the face frame (tangent t, bitangent b):
+ *   bits 0..7  - the 8 blocks around the block in front of the face (p + n + i * t + j * b, (i, j) != 0, i major)
+ *   bits 8..11 - the 4 blocks next to the face block (p + t, p - t, p + b, p - b)
+ * The per-direction bit gather from a 3x3x3 solidity mask is precomputed as well.
+ */
+struct FaceFlagTable
+{
+    uint16_t keys[1 << 12];
 
-    // assemble data
-    std::vector<TerrainVertex> dataPerMesh[6];
-    std::vector<glm::vec3> positionsPerMesh[6];
-    std::vector<Plant> plantsPerMesh[6];
-    TerrainMeshData meshes[6];
+    /// bit in the 3x3x3 neighborhood mask for each of the 12 face frame bits
+    int gatherBits[6][12];
 
-    // set mesh dir
-    for (auto pdir = 0; pdir < 6; ++pdir)
+    FaceFlagTable()
     {
-        auto dir = pdir % 3;
-        auto s = pdir < 3 ? -1 : 1;
+        auto ringBit = [](int i, int j) {
+            auto idx = (i + 1) * 3 + (j + 1);
+            return idx > 4 ? idx - 1 : idx; // skip center
+        };
 
-        // face normal/direction
-        meshes[pdir].dir = s * glm::ivec3(dir == 0, dir == 1, dir == 2);
+        for (auto m = 0; m < (1 << 12); ++m)
+        {
+            auto ring = [&](int i, int j) { return (m >> ringBit(i, j)) & 1; };
+
+            // Ambient Occlusion trick
+            auto aoAt = [&](int i, int j) {
+                auto s10 = ring(i, 0);
+                auto s01 = ring(0, j);
+                auto s11 = ring(i, j);
+
+                if (s10 && s01)
+                    s11 = 1; // corner case
+
+                return 3 - s10 - s01 - s11;
+            };
+
+            // Edge tricks
+            auto edgeAt = [&](int i, int j, int ownBit) {
+                if (ring(i, j))
+                    return 2;
+                else if ((m >> ownBit) & 1)
+                    return 1;
+                else
+                    return 0;
+            };
+
+            auto ao = glm::ivec4(aoAt(-1, -1), aoAt(-1, +1), aoAt(+1, -1), aoAt(+1, +1));
+            auto edges = glm::ivec4(edgeAt(+1, 0, 8), edgeAt(-1, 0, 9), edgeAt(0, +1, 10), edgeAt(0, -1, 11));
+            keys[m] = (uint16_t)faceKey(ao, edges);
+        }
+
+        for (auto pdir = 0; pdir < 6; ++pdir)
+        {
+            auto dir = pdir % 3;
+            auto n = (pdir < 3 ? -1 : 1) * glm::ivec3(dir == 0, dir == 1, dir == 2);
+            auto t = glm::ivec3(cross(glm::vec3(n), glm::vec3(dir == 1, dir == 2, dir == 0)));
+            auto b = glm::ivec3(cross(glm::vec3(t), glm::vec3(n)));
+
+            auto bitOf = [](glm::ivec3 o) { return (o.z + 1) * 9 + (o.y + 1) * 3 + (o.x + 1); };
+
+            for (auto i = -1; i <= 1; ++i)
+                for (auto j = -1; j <= 1; ++j)
+                    if (i != 0 || j != 0)
+                        gatherBits[pdir][ringBit(i, j)] = bitOf(n + i * t + j * b);
+
+            gatherBits[pdir][8] = bitOf(+t);
+            gatherBits[pdir][9] = bitOf(-t);
+            gatherBits[pdir][10] = bitOf(+b);
+            gatherBits[pdir][11] = bitOf(-b);
+        }
     }
 
-    // set mesh AB and VAO and AABB
-    for (auto mi = 0; mi < 6; ++mi)
+    /// AO and edge key of the face in direction pdir of a block with the given 3x3x3 solidity
+    int keyOf(uint32_t neighborhood, int pdir) const
     {
-        auto &mesh = meshes[mi];
+        auto const &bits = gatherBits[pdir];
+        uint32_t m = 0;
+        for (auto i = 0; i < 12; ++i)
+            m |= ((neighborhood >> bits[i]) & 1) << i;
+        return keys[m];
+    }
+};
+
+FaceFlagTable const faceFlags;
+
+/// Builds all meshes of a chunk in a single pass
+/// Faces are routed into per-(material, direction) streams
+/// Each block is a cell of cellSize^3 world blocks (> 1 for downsampled blocks, see downsampleBlocks)
+/// For cellSize == 1, only faces of blocks in the given sections are built
+/// (blocks outside the sections and their 1 block border may be invalid)
+/// If sectioned is true, greedy quads never cross section boundaries
+void buildMeshes(const std::vector<Block> &blocks, //
+                 glm::ivec3 chunkPos,
+                 int cellSize,
+                 SectionMask sections,
+                 bool sectioned,
+                 std::vector<TerrainMeshData> &newMeshes,
+                 World const &world,
+                 bool greedy,
+                 MeshScratch &scratch)
+{
+    // number of cells per side and chunk origin in cells
+    auto size = CHUNK_SIZE / cellSize;
+    auto origin = chunkPos / cellSize;
+
+    // downsampled meshes are not sectioned
+    if (cellSize > 1)
+        sections = allSections;
+    auto sectionCells = cellSize == 1 && sectioned ? SECTION_SIZE : size;
+    auto sectionAt = [&](glm::ivec3 lp) { return cellSize == 1 ? sectionOf(lp) : 0; };
+
+    // local cells covered by the sections
+    glm::ivec3 lo, hi;
+    sectionBounds(sections, lo, hi);
+    hi = min(hi, glm::ivec3(size));
+
+    auto block = [&blocks](glm::ivec3 ip) { return blocks[(ip.z * EXT_SIZE + ip.y) * EXT_SIZE + ip.x]; };
+
+    // occupancy bitmasks of the padded block array
+    // (only rows around the sections)
+    auto &solidRows = scratch.solidRows;
+    auto &nonAirRows = scratch.nonAirRows;
+    solidRows.assign(EXT_SIZE * EXT_SIZE, 0);
+    nonAirRows.assign(EXT_SIZE * EXT_SIZE, 0);
+
+    for (auto z = lo.z; z <= hi.z + 1; ++z)
+        for (auto y = lo.y; y <= hi.y + 1; ++y)
+        {
+            auto r = z * EXT_SIZE + y;
+            for (auto x = 0; x < EXT_SIZE; ++x)
+            {
+                auto const &b = blocks[r * EXT_SIZE + x];
+                solidRows[r] |= uint64_t(b.isSolid()) << x;
+                nonAirRows[r] |= uint64_t(!b.isAir()) << x;
+            }
+        }
+
+    // visible faces
+    auto &faceMasks = scratch.faceMasks;
+    computeFaceMasks(blocks, solidRows, nonAirRows, size, sections, cellSize > 1, faceMasks);
+
+    // materials are indexed by their first occurrence
+    std::vector<int> mats;
+    std::vector<Material const *> materials;
+    int matIndex[256];
+    std::fill(std::begin(matIndex), std::end(matIndex), -1);
 
-        // set mat
-        mesh.mat = mat;
+    auto &streams = scratch.streams;
+    for (auto &st : streams)
+        st.clear();
 
-        // prepare AABB
-        mesh.aabbMin = chunkPos + CHUNK_SIZE + 1;
-        mesh.aabbMax = chunkPos;
+    auto indexOf = [&](int8_t mat) {
+        auto &idx = matIndex[uint8_t(mat)];
+        if (idx < 0)
+        {
+            idx = (int)mats.size();
+            mats.push_back(mat);
+            materials.push_back(world.getMaterialFromIndex(mat));
+            if (streams.size() < mats.size() * 6)
+                streams.resize(mats.size() * 6);
+        }
+        return idx;
+    };
+
+    // face normals/directions
+    // packed dir 0,1,2 negative, 3,4,5 positive
+    glm::ivec3 dirs[6];
+    for (auto pdir = 0; pdir < 6; ++pdir)
+    {
+        auto dir = pdir % 3;
+        auto s = pdir < 3 ? -1 : 1;
+        dirs[pdir] = s * glm::ivec3(dir == 0, dir == 1, dir == 2);
     }
 
+    // greedy meshing: face keys per block, merged after the block loop
+    auto &faceKeys = scratch.faceKeys;
+    if (greedy)
+        for (auto &keys : faceKeys)
+            if (keys.empty())
+                keys.assign(CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE, -1);
+
     // optimized packed vertex
-    auto addVert = [&](glm::vec3 pos, int pdir, int vIdx, glm::ivec4 ao, glm::ivec4 edges) {
-        positionsPerMesh[pdir].push_back(pos);
+    // size is the quad extent in tangent and bitangent direction (in blocks)
+    // positions are chunk-local (corners are exact integers)
+    // key packs AO and edges (see faceKey)
+    auto addVert = [&](MeshStream &stream, glm::vec3 pos, int pdir, int vIdx, int key, glm::ivec2 size) {
+        auto localPos = (glm::ivec3(glm::floor(pos + 0.5f)) - origin) * cellSize;
+        assert(all(greaterThanEqual(localPos, glm::ivec3(0))) && all(lessThanEqual(localPos, glm::ivec3(CHUNK_SIZE))));
+        stream.positions.push_back(TerrainVertex::packPosition(localPos));
 
         // CAUTION: flag assembly in OPPOSITE direction
         int flags = 0;
 
-        // edges
-        flags = flags * 3 + edges.w;
-        flags = flags * 3 + edges.z;
-        flags = flags * 3 + edges.y;
-        flags = flags * 3 + edges.x;
+        // quad size
+        flags = flags * 32 + size.y - 1;
+        flags = flags * 32 + size.x - 1;
 
-        // AO
-        flags = flags * 4 + ao.w;
-        flags = flags * 4 + ao.z;
-        flags = flags * 4 + ao.y;
-        flags = flags * 4 + ao.x;
+        // edges and AO
+        flags = flags * (81 * 256) + key;
 
         // packed direction
         flags = flags * 6 + pdir;
@@ -122,93 +485,94 @@ void buildMeshFor(const std::vector<Block> &blocks,
         // assemble "vertex"
         TerrainVertex v;
         v.flags = flags;
-        dataPerMesh[pdir].push_back(v);
+        stream.data.push_back(v);
     };
 
-    for (auto z = 1; z <= CHUNK_SIZE; ++z)
-        for (auto y = 1; y <= CHUNK_SIZE; ++y)
-            for (auto x = 1; x <= CHUNK_SIZE; ++x)
+    // face frames
+    glm::vec3 tangents[6], bitangents[6];
+    for (auto pdir = 0; pdir < 6; ++pdir)
+    {
+        auto dir = pdir % 3;
+        auto dn = glm::vec3(dirs[pdir]);
+        tangents[pdir] = cross(dn, glm::vec3(dir == 1, dir == 2, dir == 0));
+        bitangents[pdir] = cross(tangents[pdir], dn);
+    }
+
+    // go over all blocks with at least one visible face
+    for (auto z = lo.z + 1; z <= hi.z; ++z)
+        for (auto y = lo.y + 1; y <= hi.y; ++y)
+        {
+            auto rowIdx = (z - 1) * CHUNK_SIZE + y - 1;
+
+            uint32_t rowFaces[6];
+            uint32_t anyFaces = 0;
+            for (auto pdir = 0; pdir < 6; ++pdir)
+                anyFaces |= rowFaces[pdir] = faceMasks[pdir][rowIdx];
+
+            for (; anyFaces; anyFaces &= anyFaces - 1)
             {
+                auto x = countTrailingZeros(anyFaces) + 1;
+
                 glm::ivec3 p = {x, y, z}; // local position
-                auto const &blk = block(p);
+                auto gp = origin + p - 1; // global position (in cells)
 
-                if (blk.mat != mat)
-                    continue; // consider only current material
+                // route to material streams
+                auto mi = indexOf(block(p).mat);
 
-                auto gp = chunkPos + p - 1; // global position
+                // shared by all faces of this block
+                auto neighborhood = solidNeighborhood(solidRows, p);
+                auto section = sectionAt(p - 1);
 
-                // go over all directions
-                // packed dir 0,1,2 negative, 3,4,5 positive
                 for (auto pdir = 0; pdir < 6; ++pdir)
                 {
-                    auto dir = pdir % 3;
-                    auto n = meshes[pdir].dir;
+                    if (!((rowFaces[pdir] >> (x - 1)) & 1))
+                        continue; // no face in this direction
 
-                    // neighbor position and block
-                    auto np = p + n;
-                    auto nblk = block(np); // "global" query
+                    auto n = dirs[pdir];
+                    auto &stream = streams[mi * 6 + pdir];
 
-                    // check if we have to gen a face
-                    bool hasFace = !nblk.isSolid() && nblk.mat != mat;
+                    auto dn = glm::vec3(n);
+                    auto dt = tangents[pdir];
+                    auto db = bitangents[pdir];
 
-                    if (hasFace)
-                    {
-                        auto dn = glm::vec3(n);
-                        auto dt = cross(dn, glm::vec3(dir == 1, dir == 2, dir == 0));
-                        auto db = cross(dt, dn);
-
-                        auto idt = glm::ivec3(dt);
-                        auto idb = glm::ivec3(db);
-
-                        auto pc = glm::vec3(gp) + 0.5f + dn * 0.5f;
-
-                        // vertex indixes
-                        auto i00 = 0;
-                        auto i01 = 1;
-                        auto i10 = 2;
-                        auto i11 = 3;
-
-                        // Calculate position
-                        auto p00 = pc - dt * 0.5f - db * 0.5f;
-                        auto p01 = pc - dt * 0.5f + db * 0.5f;
-                        auto p10 = pc + dt * 0.5f - db * 0.5f;
-                        auto p11 = pc + dt * 0.5f + db * 0.5f;
-
-                        // Ambient Occlusion trick
-                        auto a00 = aoAt(blocks, p + n, -idt, -idb);
-                        auto a01 = aoAt(blocks, p + n, -idt, +idb);
-                        auto a10 = aoAt(blocks, p + n, +idt, -idb);
-                        auto a11 = aoAt(blocks, p + n, +idt, +idb);
-
-                        glm::ivec4 ao = {a00, a01, a10, a11};
-
-                        // Edge tricks
-                        auto ePT = edgeAt(blocks, p + n, +idt, n);
-                        auto eNT = edgeAt(blocks, p + n, -idt, n);
-                        auto ePB = edgeAt(blocks, p + n, +idb, n);
-                        auto eNB = edgeAt(blocks, p + n, -idb, n);
-
-                        auto edges = glm::ivec4(ePT, eNT, ePB, eNB);
-                        // auto e00 = glm::ivec2(eNT, eNB);
-                        // auto e01 = glm::ivec2(eNT, ePB);
-                        // auto e10 = glm::ivec2(ePT, eNB);
-                        // auto e11 = glm::ivec2(ePT, ePB);
+                    auto pc = glm::vec3(gp) + 0.5f + dn * 0.5f;
 
-                        // Create face
-                        addVert(p00, pdir, i00, ao, edges);
-                        addVert(p01, pdir, i01, ao, edges);
-                        addVert(p11, pdir, i11, ao, edges);
+                    // vertex indixes
+                    auto i00 = 0;
+                    auto i01 = 1;
+                    auto i10 = 2;
+                    auto i11 = 3;
+
+                    // Calculate position
+                    auto p00 = pc - dt * 0.5f - db * 0.5f;
+                    auto p01 = pc - dt * 0.5f + db * 0.5f;
+                    auto p10 = pc + dt * 0.5f - db * 0.5f;
+                    auto p11 = pc + dt * 0.5f + db * 0.5f;
+
+                    // Ambient Occlusion and edge tricks (precomputed)
+                    auto key = faceFlags.keyOf(neighborhood, pdir);
 
-                        addVert(p00, pdir, i00, ao, edges);
-                        addVert(p11, pdir, i11, ao, edges);
-                        addVert(p10, pdir, i10, ao, edges);
+                    if (greedy)
+                    {
+                        // merged later
+                        faceKeys[pdir][((z - 1) * CHUNK_SIZE + y - 1) * CHUNK_SIZE + x - 1] = (mi << 16) + key;
+                    }
+                    else
+                    {
+                        // Create face
+                        // (4 vertices, triangulated via the shared quad index buffer)
+                        auto size = glm::ivec2(1, 1);
+                        addVert(stream, p00, pdir, i00, key, size);
+                        addVert(stream, p01, pdir, i01, key, size);
+                        addVert(stream, p11, pdir, i11, key, size);
+                        addVert(stream, p10, pdir, i10, key, size);
+                        stream.quadSections.push_back(uint8_t(section));
                     }
 
                     // Vegetation
-                    if (pdir == 4 && nblk.isAir() && material->hasGrass) // grass and up and empty
+                    if (pdir == 4 && cellSize == 1 && materials[mi]->hasGrass && block(p + n).isAir()) // grass and up and empty
                     {
-                        auto &plants = plantsPerMesh[pdir];
-
+                        auto &plants = stream.plants;
 
                         /// Plant instances are pushed into the `plants` vector
                         /// An instance has a 3D position and two directions: up and left
@@ -265,78 +629,189 @@ void buildMeshFor(const std::vector<Block> &blocks,
                         plant.up = glm::vec3(0,1,0);
                         plant.texId = 0;
                         plants.push_back(plant);
+                        stream.plantSections.push_back(uint8_t(section));
 
                         /// ============= STUDENT CODE END =============
                     }
                 }
             }
+        }
 
-    // create GPU data and write results
-    for (auto pdir = 0; pdir < 6; ++pdir)
-    {
-        auto &mesh = meshes[pdir];
+    // greedy meshing: merge coplanar faces with identical AO/edge flags into rectangles
+    // (AO and edges repeat per block via fract(vUV) in the shader)
+    if (greedy)
+        for (auto pdir = 0; pdir < 6; ++pdir)
+        {
+            auto dir = pdir % 3;
+            auto n = dirs[pdir];
+            auto dn = glm::vec3(n);
+            auto dt = cross(dn, glm::vec3(dir == 1, dir == 2, dir == 0));
+            auto db = cross(dt, dn);
+
+            // in-plane axes (positive)
+            auto ua = (dir + 1) % 3;
+            auto va = (dir + 2) % 3;
+
+            auto &keys = faceKeys[pdir];
+            auto keyAt = [&](int d, int u, int v) -> int32_t & {
+                glm::ivec3 lp;
+                lp[dir] = d;
+                lp[ua] = u;
+                lp[va] = v;
+                return keys[(lp.z * CHUNK_SIZE + lp.y) * CHUNK_SIZE + lp.x];
+            };
+
+            for (auto d = lo[dir]; d < hi[dir]; ++d)
+                for (auto v = lo[va]; v < hi[va]; ++v)
+                    for (auto u = lo[ua]; u < hi[ua]; ++u)
+                    {
+                        auto key = keyAt(d, u, v);
+                        if (key < 0)
+                            continue;
+
+                        // quads stay within their section
+                        auto uEnd = (u / sectionCells + 1) * sectionCells;
+                        auto vEnd = (v / sectionCells + 1) * sectionCells;
+
+                        // grow in u
+                        auto u1 = u + 1;
+                        while (u1 < uEnd && keyAt(d, u1, v) == key)
+                            ++u1;
+
+                        // grow in v (whole rows)
+                        auto v1 = v + 1;
+                        while (v1 < vEnd)
+                        {
+                            auto rowMatches = true;
+                            for (auto uu = u; uu < u1 && rowMatches; ++uu)
+                                rowMatches = keyAt(d, uu, v1) == key;
+                            if (!rowMatches)
+                                break;
+                            ++v1;
+                        }
+
+                        // consume faces
+                        for (auto vv = v; vv < v1; ++vv)
+                            for (auto uu = u; uu < u1; ++uu)
+                                keyAt(d, uu, vv) = -1;
+
+                        // face centers of the first and last block
+                        glm::ivec3 lp0, lp1;
+                        lp0[dir] = lp1[dir] = d;
+                        lp0[ua] = u;
+                        lp1[ua] = u1 - 1;
+                        lp0[va] = v;
+                        lp1[va] = v1 - 1;
+                        auto c0 = glm::vec3(origin + lp0) + 0.5f + dn * 0.5f;
+                        auto c1 = glm::vec3(origin + lp1) + 0.5f + dn * 0.5f;
+
+                        // merged quad
+                        auto pc = (c0 + c1) * 0.5f;
+                        auto halfT = glm::abs(dot(c1 - c0, dt)) * 0.5f + 0.5f;
+                        auto halfB = glm::abs(dot(c1 - c0, db)) * 0.5f + 0.5f;
+                        auto size = glm::ivec2(int(halfT * 2 + 0.5f), int(halfB * 2 + 0.5f));
+
+                        auto p00 = pc - dt * halfT - db * halfB;
+                        auto p01 = pc - dt * halfT + db * halfB;
+                        auto p10 = pc + dt * halfT - db * halfB;
+                        auto p11 = pc + dt * halfT + db * halfB;
+
+                        auto &stream = streams[(key >> 16) * 6 + pdir];
+                        addVert(stream, p00, pdir, 0, key & 0xFFFF, size);
+                        addVert(stream, p01, pdir, 1, key & 0xFFFF, size);
+                        addVert(stream, p11, pdir, 3, key & 0xFFFF, size);
+                        addVert(stream, p10, pdir, 2, key & 0xFFFF, size);
+                        stream.quadSections.push_back(uint8_t(sectionAt(lp0)));
+                    }
+        }
 
-        if (dataPerMesh[pdir].empty()) // no visible faces
-            continue;
+    // write results
+    // (copies leave the scratch capacity for the next job)
+    for (auto mi = 0u; mi < mats.size(); ++mi)
+        for (auto pdir = 0; pdir < 6; ++pdir)
+        {
+            auto const &stream = streams[mi * 6 + pdir];
 
-        // move new vertex data
-        mesh.vertexData = std::move(dataPerMesh[pdir]);
-        mesh.vertexPositions = std::move(positionsPerMesh[pdir]);
-        mesh.plants = std::move(plantsPerMesh[pdir]);
+            if (stream.data.empty()) // no visible faces
+                continue;
 
-        // update AABB
-        auto aabbUpdate = [&mesh](glm::vec3 p) {
-            mesh.aabbMin = min(p, mesh.aabbMin);
-            mesh.aabbMax = max(p, mesh.aabbMax);
-        };
+            assert(stream.data.size() <= TerrainMesh::maxQuads * 4 && "too many quads for the shared index buffer");
 
-        for (auto const &pos : mesh.vertexPositions)
-            aabbUpdate(pos);
-        for (auto const &p : mesh.plants)
-        {
-            aabbUpdate(p.position - p.left);
-            aabbUpdate(p.position + p.up + p.left);
-        }
+            TerrainMeshData mesh;
+            mesh.mat = mats[mi];
+            mesh.dir = dirs[pdir];
 
-        // add to result
-        newMeshes.push_back(mesh);
-    }
-}
-}
+            // copy new vertex data, sorted by section (counting sort, stable)
+            auto &start = mesh.sectionStart;
+            start.assign(SECTION_COUNT + 1, 0);
+            for (auto s : stream.quadSections)
+                ++start[s + 1];
+            for (auto s = 0; s < SECTION_COUNT; ++s)
+                start[s + 1] += start[s];
 
-std::vector<TerrainMeshData> generateMesh(const std::vector<Block> &blocks, glm::ivec3 chunkPos, World const &world)
-{
-    GLOW_ACTION("[WORKER] - create mesh"); // time this method (shown on shutdown)
+            auto quadCount = stream.quadSections.size();
+            assert(quadCount * 4 == stream.data.size());
+            mesh.vertexData.resize(quadCount * 4);
+            mesh.vertexPositions.resize(quadCount * 4);
 
-    std::vector<int> built;                 // track already built materials
-    std::vector<TerrainMeshData> newMeshes; // build new mesh list
+            int next[SECTION_COUNT];
+            std::copy(start.begin(), start.end() - 1, next);
+            for (auto q = 0u; q < quadCount; ++q)
+            {
+                auto dst = next[stream.quadSections[q]]++ * 4;
+                std::copy_n(stream.data.begin() + q * 4, 4, mesh.vertexData.begin() + dst);
+                std::copy_n(stream.positions.begin() + q * 4, 4, mesh.vertexPositions.begin() + dst);
+            }
 
-    auto block = [&blocks](int x, int y, int z) { return blocks[(z * EXT_SIZE + y) * EXT_SIZE + x]; };
+            mesh.plants.assign(stream.plants.begin(), stream.plants.end());
+            mesh.plantSections.assign(stream.plantSections.begin(), stream.plantSections.end());
 
-    auto hasMat = [&built](int mat) {
-        for (auto m : built)
-            if (m == mat)
-                return true;
-        return false;
-    };
+            // AABB
+            mesh.aabbMin = chunkPos + CHUNK_SIZE + 1;
+            mesh.aabbMax = chunkPos;
 
-    // ensure that each material is accounted for
-    for (auto z = 1; z <= CHUNK_SIZE; ++z)
-        for (auto y = 1; y <= CHUNK_SIZE; ++y)
-            for (auto x = 1; x <= CHUNK_SIZE; ++x)
+            auto aabbUpdate = [&mesh](glm::vec3 p) {
+                mesh.aabbMin = min(p, mesh.aabbMin);
+                mesh.aabbMax = max(p, mesh.aabbMax);
+            };
+
+            for (auto pos : mesh.vertexPositions)
+                aabbUpdate(glm::vec3(chunkPos + TerrainVertex::unpackPosition(pos)));
+            for (auto const &p : mesh.plants)
             {
-                auto const &b = block(x, y, z); // get block
+                aabbUpdate(p.position - p.left);
+                aabbUpdate(p.position + p.up + p.left);
+            }
 
-                // if block material is not air and not already built
-                if (!b.isAir() && !hasMat(b.mat))
-                {
-                    // mark as built
-                    built.push_back(b.mat);
+            // add to result
+            newMeshes.push_back(std::move(mesh));
+        }
+}
+}
 
-                    // create VAO(s)
-                    buildMeshFor(blocks, chunkPos, b.mat, newMeshes, world);
-                }
-            }
+std::vector<TerrainMeshData> generateMesh(const std::vector<Block> &blocks,
+                                          glm::ivec3 chunkPos,
+                                          World const &world,
+                                          bool greedy,
+                                          int lod,
+                                          SectionMask sections,
+                                          bool sectioned)
+{
+    assert((sectioned || sections == allSections) && "partial meshes must be sectioned");
+
+    GLOW_ACTION("[WORKER] - create mesh"); // time this method (shown on shutdown)
+
+    // per-thread scratch memory (worker threads mesh many chunks)
+    static thread_local MeshScratch scratch;
 
+    std::vector<TerrainMeshData> newMeshes; // build new mesh list
+    if (lod == 0)
+        buildMeshes(blocks, chunkPos, 1, sections, sectioned, newMeshes, world, greedy, scratch);
+    else
+    {
+        auto cellSize = 1 << lod;
+        downsampleBlocks(blocks, cellSize, scratch.coarseBlocks);
+        buildMeshes(scratch.coarseBlocks, chunkPos, cellSize, allSections, false, newMeshes, world, greedy, scratch);
+    }
     return newMeshes;
 }
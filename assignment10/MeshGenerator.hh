@@ -9,4 +9,16 @@ class World;
 
 /// Generates mesh data for a given array of blocks
 /// Blocks contain 1 neighborhood
-std::vector<TerrainMeshData> generateMesh(std::vector<Block> const& blocks, glm::ivec3 chunkPos, World const& world);
+/// If greedy is true, coplanar faces with identical material, AO and edge flags are merged into larger quads
+/// For lod > 0, the blocks are downsampled to cells of 2^lod blocks per side (majority material)
+/// and surface faces at the chunk sides are always emitted (skirts hide cracks between different levels)
+/// Quads are sorted by section (see TerrainMeshData::sectionStart)
+/// For lod == 0, only faces of the given sections are generated (all sections for lod > 0)
+/// If sectioned is true, greedy quads never cross section boundaries (required for partial updates)
+std::vector<TerrainMeshData> generateMesh(std::vector<Block> const& blocks,
+                                          glm::ivec3 chunkPos,
+                                          World const& world,
+                                          bool greedy = false,
+                                          int lod = 0,
+                                          SectionMask sections = allSections,
+                                          bool sectioned = false);
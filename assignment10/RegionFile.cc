@@ -0,0 +1,261 @@
+#include "RegionFile.hh"
+
+#include <cstring>
+
+#ifdef _WIN32
+#include <direct.h>
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <glow/common/log.hh>
+
+#include "BlockStorage.hh"
+#include "Constants.hh"
+
+namespace
+{
+const char regionMagic[4] = {'R', 'G', 'N', 'F'};
+const uint32_t regionVersion = 1;
+const size_t regionHeaderSize = sizeof(regionMagic) + sizeof(uint32_t);
+
+/// floor division by the region size
+int regionCoord(int chunkIdx)
+{
+    return chunkIdx >= 0 ? chunkIdx / RegionFile::size : (chunkIdx - RegionFile::size + 1) / RegionFile::size;
+}
+}
+
+RegionFile::RegionFile(std::string const& path, bool create) : mPath(path), mTable(chunkCount, Entry{0, 0})
+{
+    auto tableBytes = chunkCount * sizeof(Entry);
+
+    mFile = fopen(path.c_str(), "r+b");
+    if (!mFile)
+    {
+        if (!create)
+            return; // does not exist
+
+        // write empty region
+        mFile = fopen(path.c_str(), "w+b");
+        if (!mFile)
+        {
+            glow::error() << "Unable to create region file " << path;
+            return;
+        }
+
+        fwrite(regionMagic, sizeof(regionMagic), 1, mFile);
+        fwrite(&regionVersion, sizeof(regionVersion), 1, mFile);
+        fwrite(mTable.data(), tableBytes, 1, mFile);
+        fflush(mFile);
+        mFileSize = regionHeaderSize + tableBytes;
+        return;
+    }
+
+    // read header and table
+    char magic[4];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, mFile) != 1 || fread(&version, sizeof(version), 1, mFile) != 1 //
+        || memcmp(magic, regionMagic, sizeof(magic)) != 0 || version != regionVersion
+        || fread(mTable.data(), tableBytes, 1, mFile) != 1)
+    {
+        glow::error() << "Invalid region file " << path << ", ignoring it";
+        fclose(mFile);
+        mFile = nullptr;
+        mTable.assign(chunkCount, Entry{0, 0});
+        return;
+    }
+
+    fseek(mFile, 0, SEEK_END);
+    mFileSize = ftell(mFile);
+}
+
+RegionFile::~RegionFile()
+{
+    if (mFile)
+        fclose(mFile);
+}
+
+int RegionFile::chunkIndex(glm::ivec3 chunkIdx)
+{
+    auto l = glm::ivec3(chunkIdx.x - regionCoord(chunkIdx.x) * size, //
+                        chunkIdx.y - regionCoord(chunkIdx.y) * size, //
+                        chunkIdx.z - regionCoord(chunkIdx.z) * size);
+    return (l.z * size + l.y) * size + l.x;
+}
+
+bool RegionFile::findChunk(int idx, ChunkData& chunk)
+{
+    if (!isOpen() || !hasChunk(idx))
+        return false;
+
+    auto const& e = mTable[idx];
+    if (size_t(e.offset) + e.size > mFileSize)
+    {
+        glow::error() << "Corrupt chunk entry in " << mPath;
+        return false;
+    }
+
+    if (!map(size_t(e.offset) + e.size))
+        return false;
+
+    chunk.mapping = mMapping;
+    chunk.data = mMapping->data + e.offset;
+    chunk.size = e.size;
+    return true;
+}
+
+bool RegionFile::writeChunk(int idx, std::vector<char> const& data)
+{
+    if (!isOpen() || data.empty())
+        return false;
+
+    if (mFileSize + data.size() > UINT32_MAX)
+    {
+        glow::error() << "Region file " << mPath << " is full";
+        return false;
+    }
+
+    // append data (the current mapping stays valid, it does not contain the new data)
+    Entry e = {uint32_t(mFileSize), uint32_t(data.size())};
+    fseek(mFile, 0, SEEK_END);
+    if (fwrite(data.data(), data.size(), 1, mFile) != 1)
+    {
+        glow::error() << "Unable to write to " << mPath;
+        return false;
+    }
+    mFileSize += data.size();
+
+    // update table (after data, so that a partial write never references garbage)
+    fseek(mFile, long(regionHeaderSize + idx * sizeof(Entry)), SEEK_SET);
+    fwrite(&e, sizeof(e), 1, mFile);
+    fflush(mFile);
+    mTable[idx] = e;
+
+    return true;
+}
+
+bool RegionFile::map(size_t end)
+{
+    if (mMapping && mMapping->size >= end)
+        return true; // already mapped
+
+    // the previous mapping is released by its last reader
+    std::shared_ptr<Mapping> m(new Mapping);
+#ifdef _WIN32
+    m->fileHandle = CreateFileA(mPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m->fileHandle == INVALID_HANDLE_VALUE)
+    {
+        m->fileHandle = nullptr;
+        return false;
+    }
+
+    m->mapHandle = CreateFileMappingA(m->fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m->mapHandle)
+        m->data = (char const*)MapViewOfFile(m->mapHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+    auto fd = open(mPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    auto ptr = mmap(nullptr, mFileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // mapping stays valid
+    if (ptr != MAP_FAILED)
+        m->data = (char const*)ptr;
+#endif
+
+    if (!m->data)
+    {
+        glow::error() << "Unable to map " << mPath;
+        return false;
+    }
+
+    m->size = mFileSize;
+    mMapping = std::move(m);
+    return true;
+}
+
+RegionFile::Mapping::~Mapping()
+{
+#ifdef _WIN32
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapHandle)
+        CloseHandle(mapHandle);
+    if (fileHandle)
+        CloseHandle(fileHandle);
+#else
+    if (data)
+        munmap((void*)data, size);
+#endif
+}
+
+RegionStore::RegionStore(std::string const& directory) : mDirectory(directory) {}
+
+RegionFile* RegionStore::region(glm::ivec3 chunkIdx, bool create)
+{
+    auto key = std::make_tuple(regionCoord(chunkIdx.x), regionCoord(chunkIdx.y), regionCoord(chunkIdx.z));
+
+    // missing files are cached as nullptr (only re-checked when creating)
+    auto it = mRegions.find(key);
+    if (it != mRegions.end() && (it->second || !create))
+        return it->second.get();
+
+    if (create && !mHasDirectory)
+    {
+#ifdef _WIN32
+        _mkdir(mDirectory.c_str());
+#else
+        mkdir(mDirectory.c_str(), 0755);
+#endif
+        mHasDirectory = true;
+    }
+
+    auto path = mDirectory + "/r." + std::to_string(std::get<0>(key)) + "." + std::to_string(std::get<1>(key)) + "."
+                + std::to_string(std::get<2>(key)) + ".region";
+    std::unique_ptr<RegionFile> r(new RegionFile(path, create));
+    if (!r->isOpen())
+        r = nullptr;
+
+    auto& slot = mRegions[key];
+    slot = std::move(r);
+    return slot.get();
+}
+
+bool RegionStore::load(glm::ivec3 chunkPos, BlockStorage& blocks)
+{
+    auto chunkIdx = chunkPos / CHUNK_SIZE;
+
+    // only locate the data under the lock (decoding runs in parallel)
+    RegionFile::ChunkData chunk;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto r = region(chunkIdx, false);
+        if (!r || !r->findChunk(RegionFile::chunkIndex(chunkIdx), chunk))
+            return false;
+    }
+
+    return blocks.decode(chunk.data, chunk.size);
+}
+
+bool RegionStore::save(glm::ivec3 chunkPos, BlockStorage const& blocks)
+{
+    auto chunkIdx = chunkPos / CHUNK_SIZE;
+
+    // encode outside of the lock
+    std::vector<char> data;
+    blocks.encode(data);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto r = region(chunkIdx, true);
+    if (!r)
+        return false;
+
+    return r->writeChunk(RegionFile::chunkIndex(chunkIdx), data);
+}
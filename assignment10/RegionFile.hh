@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class BlockStorage;
+
+/// A region file stores the blocks of REGION_SIZE^3 chunks
+///
+/// Layout:
+///   header: magic (4 bytes), version (uint32)
+///   table:  one {offset, size} entry (2x uint32) per chunk, size == 0 means "not stored"
+///   data:   encoded BlockStorages (see BlockStorage::encode), appended on write
+///
+/// The file is memory-mapped for reading, chunks are decoded directly from the mapping.
+/// Re-written chunks are appended and the table entry is updated afterwards
+/// (old data is not reclaimed, so existing mappings stay valid and are only renewed
+/// when a chunk beyond their end is read).
+class RegionFile
+{
+public:
+    /// number of chunks per region in each direction
+    static const int size = 16;
+    static const int chunkCount = size * size * size;
+
+private:
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    /// path of the file
+    std::string mPath;
+
+    /// chunk table (copy of the on-disk table)
+    std::vector<Entry> mTable;
+
+    /// file handle for writing
+    FILE* mFile = nullptr;
+    /// current file size
+    size_t mFileSize = 0;
+
+    /// read-only mapping of a file prefix (released by its last user)
+    struct Mapping
+    {
+        char const* data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        void* fileHandle = nullptr;
+        void* mapHandle = nullptr;
+#endif
+        ~Mapping();
+    };
+    /// current mapping (nullptr if not mapped yet)
+    std::shared_ptr<Mapping const> mMapping;
+
+public: // ctor
+    /// opens (or creates if `create` is true) a region file
+    /// check isOpen() afterwards
+    RegionFile(std::string const& path, bool create);
+    ~RegionFile();
+
+    RegionFile(RegionFile const&) = delete;
+    RegionFile& operator=(RegionFile const&) = delete;
+
+public: // properties
+    bool isOpen() const { return mFile != nullptr; }
+
+    /// true iff the chunk with the given region-local index is stored
+    bool hasChunk(int idx) const { return mTable[idx].size > 0; }
+
+public: // io
+    /// encoded data of a stored chunk (keeps its mapping alive, see BlockStorage::decode)
+    struct ChunkData
+    {
+        std::shared_ptr<void const> mapping;
+        char const* data = nullptr;
+        size_t size = 0;
+    };
+
+    /// locates a stored chunk (mapping the file if necessary)
+    /// returns false if not stored or corrupt
+    /// the data stays valid after later writes (decoding does not need the region anymore)
+    bool findChunk(int idx, ChunkData& chunk);
+
+    /// stores an encoded chunk (appends data, then updates the table)
+    bool writeChunk(int idx, std::vector<char> const& data);
+
+    /// region-local index of a chunk index (chunkPos / CHUNK_SIZE)
+    static int chunkIndex(glm::ivec3 chunkIdx);
+
+private: // helper
+    /// maps the whole file if the current mapping does not contain `end` bytes
+    bool map(size_t end);
+};
+
+/// Collection of region files in a directory
+///
+/// Thread-safe: chunks are loaded by the terrain workers and saved by the main thread.
+/// The lock is only held to locate and write chunks, decoding and encoding run in parallel.
+class RegionStore
+{
+private:
+    /// directory of the region files
+    std::string mDirectory;
+
+    std::mutex mMutex;
+
+    /// opened regions (nullptr if the file does not exist)
+    std::map<std::tuple<int, int, int>, std::unique_ptr<RegionFile>> mRegions;
+
+    /// true iff the directory was created
+    bool mHasDirectory = false;
+
+public:
+    explicit RegionStore(std::string const& directory);
+
+    /// tries to load a chunk, returns false if it was never saved
+    bool load(glm::ivec3 chunkPos, BlockStorage& blocks);
+
+    /// saves a chunk
+    bool save(glm::ivec3 chunkPos, BlockStorage const& blocks);
+
+private: // helper
+    /// returns the region containing a chunk
+    /// (nullptr if it does not exist and `create` is false)
+    RegionFile* region(glm::ivec3 chunkIdx, bool create);
+};
@@ -0,0 +1,243 @@
+#include "SoftwareOcclusion.hh"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+/// box faces as corner indices (bit 0: x, bit 1: y, bit 2: z), order -x, +x, -y, +y, -z, +z
+int const boxFaces[6][4] = {
+    {0, 4, 6, 2}, //
+    {1, 3, 7, 5}, //
+    {0, 1, 5, 4}, //
+    {2, 6, 7, 3}, //
+    {0, 2, 3, 1}, //
+    {4, 5, 7, 6}, //
+};
+
+glm::vec3 corner(glm::vec3 amin, glm::vec3 amax, int i)
+{
+    return {i & 1 ? amax.x : amin.x, i & 2 ? amax.y : amin.y, i & 4 ? amax.z : amin.z};
+}
+
+/// signed distance to the near plane in clip space (inside iff >= 0)
+float nearDistance(glm::vec4 const& p)
+{
+    return p.z + p.w;
+}
+}
+
+SoftwareOcclusion::SoftwareOcclusion() : mDepth(width * height, 0.0f) {}
+
+void SoftwareOcclusion::begin(glm::mat4 const& viewProj, glm::vec3 camPos)
+{
+    mViewProj = viewProj;
+    mCamPos = camPos;
+    mOccluderCount = 0;
+    mTriangles.clear();
+    std::fill(mDepth.begin(), mDepth.end(), 0.0f);
+}
+
+void SoftwareOcclusion::addOccluder(glm::vec3 amin, glm::vec3 amax)
+{
+    ++mOccluderCount;
+
+    glm::vec4 clip[8];
+    for (auto i = 0; i < 8; ++i)
+        clip[i] = mViewProj * glm::vec4(corner(amin, amax, i), 1.0f);
+
+    auto toScreen = [](glm::vec4 const& p) {
+        return glm::vec3((p.x / p.w * 0.5f + 0.5f) * width, (p.y / p.w * 0.5f + 0.5f) * height, 1.0f / p.w);
+    };
+
+    for (auto f = 0; f < 6; ++f)
+    {
+        // only faces towards the camera (the others are behind them)
+        auto axis = f / 2;
+        auto facesCamera = f % 2 == 0 ? mCamPos[axis] < amin[axis] : mCamPos[axis] > amax[axis];
+        if (!facesCamera)
+            continue;
+
+        // clip the face at the near plane (at most 5 vertices)
+        glm::vec4 poly[5];
+        auto n = 0;
+        for (auto i = 0; i < 4; ++i)
+        {
+            auto const& p = clip[boxFaces[f][i]];
+            auto const& q = clip[boxFaces[f][(i + 1) % 4]];
+            auto dp = nearDistance(p);
+            auto dq = nearDistance(q);
+
+            if (dp >= 0)
+                poly[n++] = p;
+            if ((dp >= 0) != (dq >= 0))
+                poly[n++] = p + (q - p) * (dp / (dp - dq));
+        }
+        if (n < 3)
+            continue; // completely behind the near plane
+
+        // rasterize as fan
+        glm::vec3 screen[5];
+        for (auto i = 0; i < n; ++i)
+            screen[i] = toScreen(poly[i]);
+        for (auto i = 1; i + 1 < n; ++i)
+            addTriangle(screen[0], screen[i], screen[i + 1]);
+    }
+}
+
+void SoftwareOcclusion::addTriangle(glm::vec3 a, glm::vec3 b, glm::vec3 c)
+{
+    // consistent orientation
+    auto area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (area == 0)
+        return;
+    if (area < 0)
+    {
+        std::swap(b, c);
+        area = -area;
+    }
+
+    // pixel bounds (pixel centers are at +0.5)
+    Triangle t;
+    t.x0 = std::max(0, (int)std::ceil(std::min({a.x, b.x, c.x}) - 0.5f));
+    t.x1 = std::min(width - 1, (int)std::floor(std::max({a.x, b.x, c.x}) - 0.5f));
+    t.y0 = std::max(0, (int)std::ceil(std::min({a.y, b.y, c.y}) - 0.5f));
+    t.y1 = std::min(height - 1, (int)std::floor(std::max({a.y, b.y, c.y}) - 0.5f));
+    if (t.x0 > t.x1 || t.y0 > t.y1)
+        return;
+
+    // edge functions (weights of a, b, c)
+    t.ex[0] = b.y - c.y, t.ey[0] = c.x - b.x, t.e0[0] = b.x * c.y - b.y * c.x;
+    t.ex[1] = c.y - a.y, t.ey[1] = a.x - c.x, t.e0[1] = c.x * a.y - c.y * a.x;
+    t.ex[2] = a.y - b.y, t.ey[2] = b.x - a.x, t.e0[2] = a.x * b.y - a.y * b.x;
+
+    // 1 / w
+    auto invArea = 1.0f / area;
+    t.dzdx = (t.ex[0] * a.z + t.ex[1] * b.z + t.ex[2] * c.z) * invArea;
+    t.dzdy = (t.ey[0] * a.z + t.ey[1] * b.z + t.ey[2] * c.z) * invArea;
+    t.z0 = (t.e0[0] * a.z + t.e0[1] * b.z + t.e0[2] * c.z) * invArea;
+
+    mTriangles.push_back(t);
+}
+
+void SoftwareOcclusion::rasterizeTile(int tile)
+{
+    auto tileY0 = tile * tileHeight;
+    auto tileY1 = tileY0 + tileHeight - 1;
+
+    for (auto const& t : mTriangles)
+    {
+        auto y0 = std::max(t.y0, tileY0);
+        auto y1 = std::min(t.y1, tileY1);
+
+#if defined(__SSE2__)
+        auto ex0 = _mm_set1_ps(t.ex[0]);
+        auto ex1 = _mm_set1_ps(t.ex[1]);
+        auto ex2 = _mm_set1_ps(t.ex[2]);
+        auto dzdx = _mm_set1_ps(t.dzdx);
+        auto zero = _mm_setzero_ps();
+        auto four = _mm_set1_ps(4.0f);
+#endif
+
+        for (auto y = y0; y <= y1; ++y)
+        {
+            auto row = &mDepth[y * width];
+
+            // edge functions and depth at x = 0 of this row
+            auto py = y + 0.5f;
+            auto r0 = t.ey[0] * py + t.e0[0];
+            auto r1 = t.ey[1] * py + t.e0[1];
+            auto r2 = t.ey[2] * py + t.e0[2];
+            auto rz = t.dzdy * py + t.z0;
+
+            auto x = t.x0;
+
+#if defined(__SSE2__)
+            // 4 pixels at once (pixel centers are exact, so the values match the scalar loop)
+            auto vr0 = _mm_set1_ps(r0);
+            auto vr1 = _mm_set1_ps(r1);
+            auto vr2 = _mm_set1_ps(r2);
+            auto vrz = _mm_set1_ps(rz);
+            auto px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+            for (; x + 3 <= t.x1; x += 4, px = _mm_add_ps(px, four))
+            {
+                auto w0 = _mm_add_ps(_mm_mul_ps(ex0, px), vr0);
+                auto w1 = _mm_add_ps(_mm_mul_ps(ex1, px), vr1);
+                auto w2 = _mm_add_ps(_mm_mul_ps(ex2, px), vr2);
+                auto z = _mm_add_ps(_mm_mul_ps(dzdx, px), vrz);
+                auto depth = _mm_loadu_ps(row + x);
+
+                auto inside = _mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero));
+                auto write = _mm_and_ps(_mm_and_ps(inside, _mm_cmpge_ps(w2, zero)), _mm_cmpgt_ps(z, depth));
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(write, z), _mm_andnot_ps(write, depth)));
+            }
+#endif
+
+            for (; x <= t.x1; ++x)
+            {
+                auto px = x + 0.5f;
+                auto z = t.dzdx * px + rz;
+                if (t.ex[0] * px + r0 >= 0 && t.ex[1] * px + r1 >= 0 && t.ex[2] * px + r2 >= 0 && z > row[x])
+                    row[x] = z;
+            }
+        }
+    }
+}
+
+bool SoftwareOcclusion::isOccluded(glm::vec3 amin, glm::vec3 amax) const
+{
+    if (mOccluderCount == 0)
+        return false;
+
+    // screen rectangle and nearest depth
+    auto sminX = (float)width, smaxX = 0.0f;
+    auto sminY = (float)height, smaxY = 0.0f;
+    auto maxInvW = 0.0f;
+    for (auto i = 0; i < 8; ++i)
+    {
+        auto p = mViewProj * glm::vec4(corner(amin, amax, i), 1.0f);
+        if (nearDistance(p) <= 0)
+            return false; // crosses the near plane
+
+        auto sx = (p.x / p.w * 0.5f + 0.5f) * width;
+        auto sy = (p.y / p.w * 0.5f + 0.5f) * height;
+        sminX = std::min(sminX, sx);
+        smaxX = std::max(smaxX, sx);
+        sminY = std::min(sminY, sy);
+        smaxY = std::max(smaxY, sy);
+        maxInvW = std::max(maxInvW, 1.0f / p.w);
+    }
+
+    // all pixels the rectangle touches, dilated by one pixel
+    // (occluders are sampled at pixel centers, so their silhouette pixels are only partly covered)
+    auto x0 = std::max(0, (int)std::floor(sminX) - 1);
+    auto x1 = std::min(width - 1, (int)std::floor(smaxX) + 1);
+    auto y0 = std::max(0, (int)std::floor(sminY) - 1);
+    auto y1 = std::min(height - 1, (int)std::floor(smaxY) + 1);
+    if (x0 > x1 || y0 > y1)
+        return false; // off-screen (left to frustum culling)
+
+    for (auto y = y0; y <= y1; ++y)
+    {
+        auto row = &mDepth[y * width];
+        auto x = x0;
+
+#if defined(__SSE2__)
+        // 4 pixels at once: visible if any stored depth is not in front of the box
+        auto vz = _mm_set1_ps(maxInvW);
+        for (; x + 3 <= x1; x += 4)
+            if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(row + x), vz)))
+                return false;
+#endif
+
+        for (; x <= x1; ++x)
+            if (row[x] <= maxInvW)
+                return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/**
+ * @brief Low-resolution CPU depth buffer for occlusion culling
+ *
+ * Completely opaque boxes (occluders) are rasterized into a 256 x 128 depth buffer,
+ * other boxes are then tested against it before any GL work is issued.
+ * The buffer is split into horizontal tiles that are rasterized independently (e.g. one task per tile),
+ * the inner loops process 4 pixels at once (SSE2, scalar fallback).
+ * A box is occluded iff its nearest depth lies behind the buffer at every pixel its screen rectangle touches.
+ *
+ * Occluders are clipped at the near plane and only their faces towards the camera are rasterized.
+ * The buffer stores 1 / w (0 is infinitely far), which is linear in screen space
+ * and keeps its precision far away from the camera (unlike NDC depth).
+ * Occluders are sampled at pixel centers, so parts of a box thinner than a buffer pixel
+ * can still be visible next to an occluder silhouette (like in other software occlusion culling).
+ *
+ * Usage:
+ *   occlusion.begin(viewProj, camPos);
+ *   occlusion.addOccluder(...);   // all occluders
+ *   occlusion.rasterizeTile(...); // all tiles (thread-safe for different tiles)
+ *   occlusion.isOccluded(...);    // all tests (thread-safe)
+ */
+class SoftwareOcclusion
+{
+public:
+    static const int width = 256;
+    static const int height = 128;
+
+    /// rows per tile (see rasterizeTile)
+    static const int tileHeight = 16;
+    static const int tileCount = height / tileHeight;
+
+private:
+    /// row-major, bottom row first
+    std::vector<float> mDepth;
+
+    /// screen space triangle of an occluder
+    /// edge functions e(x, y) = ex * x + ey * y + e0 are the barycentric weights times area,
+    /// 1 / w is a plane over screen space
+    struct Triangle
+    {
+        int x0, x1, y0, y1; ///< pixel bounds (inclusive, clamped to the buffer)
+        float ex[3], ey[3], e0[3];
+        float dzdx, dzdy, z0;
+    };
+    std::vector<Triangle> mTriangles;
+
+    glm::mat4 mViewProj;
+    glm::vec3 mCamPos;
+
+    int mOccluderCount = 0;
+
+public:
+    SoftwareOcclusion();
+
+    /// clears the depth buffer and sets the camera
+    void begin(glm::mat4 const& viewProj, glm::vec3 camPos);
+
+    /// adds a completely opaque box (its faces are rasterized in rasterizeTile)
+    void addOccluder(glm::vec3 amin, glm::vec3 amax);
+
+    /// rasterizes all occluders into the rows of a tile (0 .. tileCount-1), keeps the nearest depth
+    /// (different tiles can be rasterized in parallel)
+    void rasterizeTile(int tile);
+
+    /// true iff the box is completely hidden by the occluders
+    /// (boxes crossing the near plane are never occluded)
+    bool isOccluded(glm::vec3 amin, glm::vec3 amax) const;
+
+    /// number of occluders since begin
+    int occluderCount() const { return mOccluderCount; }
+
+    /// depth buffer (for debugging)
+    std::vector<float> const& depth() const { return mDepth; }
+
+private:
+    /// sets up a triangle given in screen space (pixels, z is 1 / w)
+    void addTriangle(glm::vec3 a, glm::vec3 b, glm::vec3 c);
+};
@@ -0,0 +1,90 @@
+#include "TaskPool.hh"
+
+#include <algorithm>
+
+TaskPool::TaskPool(int threadCount)
+{
+    if (threadCount < 0)
+        threadCount = std::max(0, (int)std::thread::hardware_concurrency() - 1);
+
+    // launch threads here (after member init)
+    for (auto i = 0; i < threadCount; ++i)
+        mThreads.push_back(std::thread([](TaskPool* p) { p->run(); }, this));
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mShouldStop = true;
+    }
+    mBatchStarted.notify_all();
+
+    for (auto& t : mThreads)
+        t.join();
+}
+
+void TaskPool::parallelFor(int count, std::function<void(int)> const& task)
+{
+    if (count <= 0)
+        return;
+
+    // not worth waking anyone
+    if (count == 1 || mThreads.empty())
+    {
+        for (auto i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTask = &task;
+        mTaskCount = count;
+        mNextIndex = 0;
+        mThreadsFinished = 0;
+        ++mBatch;
+    }
+    mBatchStarted.notify_all();
+
+    work(task, count);
+
+    // every thread has to leave the batch before `task` goes out of scope
+    std::unique_lock<std::mutex> lock(mMutex);
+    mBatchFinished.wait(lock, [&] { return mThreadsFinished == (int)mThreads.size(); });
+    mTask = nullptr;
+}
+
+void TaskPool::run()
+{
+    auto batch = 0;
+    while (true)
+    {
+        std::function<void(int)> const* task;
+        int count;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mBatchStarted.wait(lock, [&] { return mShouldStop || mBatch != batch; });
+            if (mShouldStop)
+                return;
+
+            batch = mBatch;
+            task = mTask;
+            count = mTaskCount;
+        }
+
+        work(*task, count);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ++mThreadsFinished;
+        }
+        mBatchFinished.notify_one();
+    }
+}
+
+void TaskPool::work(std::function<void(int)> const& task, int count)
+{
+    for (auto i = mNextIndex++; i < count; i = mNextIndex++)
+        task(i);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Small pool of threads for short, per-frame tasks (e.g. culling)
+ *
+ * parallelFor distributes the indices of a batch dynamically over all threads,
+ * the calling thread participates and returns once every index was processed.
+ * Threads sleep on a condition variable between batches.
+ *
+ * Unlike the TerrainWorker, tasks must not block: a batch is as slow as its slowest task.
+ */
+class TaskPool
+{
+private:
+    std::vector<std::thread> mThreads;
+
+    std::mutex mMutex;
+    std::condition_variable mBatchStarted;
+    std::condition_variable mBatchFinished;
+    bool mShouldStop = false;
+
+    // current batch (guarded by mMutex, except mNextIndex)
+    std::function<void(int)> const* mTask = nullptr;
+    int mTaskCount = 0;
+    int mBatch = 0;
+    int mThreadsFinished = 0;
+    std::atomic<int> mNextIndex{0};
+
+public:
+    /// creates a pool with `threadCount` additional threads (-1 means one less than the number of cores)
+    explicit TaskPool(int threadCount = -1);
+    ~TaskPool();
+
+    TaskPool(TaskPool const&) = delete;
+    TaskPool& operator=(TaskPool const&) = delete;
+
+    /// number of threads working on a batch (including the calling one)
+    int threadCount() const { return (int)mThreads.size() + 1; }
+
+    /// calls task(i) for all i in 0 .. count-1 (in any order and on any thread)
+    /// blocks until all calls are finished (not reentrant, main thread only)
+    void parallelFor(int count, std::function<void(int)> const& task);
+
+private:
+    /// thread execution
+    void run();
+
+    /// processes indices of the current batch until none are left
+    void work(std::function<void(int)> const& task, int count);
+};
@@ -0,0 +1,354 @@
+#include "TerrainBuffers.hh"
+
+#include <cassert>
+#include <cstring>
+
+#include <glow/common/log.hh>
+#include <glow/common/profiling.hh>
+
+#include <glow/objects/ArrayBuffer.hh>
+#include <glow/objects/ElementArrayBuffer.hh>
+#include <glow/objects/VertexArray.hh>
+
+#include "Vertices.hh"
+
+using namespace glow;
+
+static_assert(sizeof(uint32_t) == 4 && sizeof(TerrainVertex) == 4, "16 bytes per quad and buffer");
+
+TerrainArena::TerrainArena(int quadCapacity, bool immutable, SharedArrayBuffer const& abDrawOrigins)
+  : quadCapacity(quadCapacity)
+{
+    abPositions = ArrayBuffer::create();
+    abPositions->defineAttribute<uint32_t>("aPosition");
+    abData = ArrayBuffer::create(TerrainVertex::attributes());
+
+    for (auto const& ab : {abPositions, abData})
+    {
+        auto bytes = size_t(quadCapacity) * 4 * 4;
+        if (immutable)
+        {
+            // written by copies and (as fallback) glBufferSubData
+            glBindBuffer(GL_COPY_WRITE_BUFFER, ab->getObjectName());
+            glBufferStorage(GL_COPY_WRITE_BUFFER, bytes, nullptr, GL_DYNAMIC_STORAGE_BIT);
+        }
+        else
+            ab->bind().setData(bytes, nullptr, GL_DYNAMIC_DRAW);
+    }
+
+    vaoFull = VertexArray::create({abPositions, abData, abDrawOrigins}, TerrainMesh::quadIndices());
+    vaoPosOnly = VertexArray::create({abPositions, abDrawOrigins}, TerrainMesh::quadIndices());
+
+    mFreeRanges[0] = quadCapacity;
+}
+
+int TerrainArena::allocate(int quads)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto it = mFreeRanges.begin(); it != mFreeRanges.end(); ++it)
+        if (it->second >= quads)
+        {
+            auto first = it->first;
+            auto rest = it->second - quads;
+            mFreeRanges.erase(it);
+            if (rest > 0)
+                mFreeRanges[first + quads] = rest;
+            return first;
+        }
+    return -1;
+}
+
+void TerrainArena::free(int firstQuad, int quads)
+{
+    if (quads <= 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mFreeRanges.emplace(firstQuad, quads).first;
+
+    // merge with successor
+    auto next = std::next(it);
+    if (next != mFreeRanges.end() && it->first + it->second == next->first)
+    {
+        it->second += next->second;
+        mFreeRanges.erase(next);
+    }
+
+    // merge with predecessor
+    if (it != mFreeRanges.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first)
+        {
+            prev->second += it->second;
+            mFreeRanges.erase(it);
+        }
+    }
+}
+
+TerrainBuffers::~TerrainBuffers()
+{
+    if (mIndirectBuffer)
+        glDeleteBuffers(1, &mIndirectBuffer);
+
+    for (auto const& f : mFences)
+        glDeleteSync(f.fence);
+
+    if (mStagingBuffer)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, mStagingBuffer);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glDeleteBuffers(1, &mStagingBuffer);
+    }
+}
+
+void TerrainBuffers::init()
+{
+    // per-draw chunk origins
+    mDrawOrigins = ArrayBuffer::create();
+    mDrawOrigins->defineAttribute<glm::vec3>("aChunkOrigin");
+    mDrawOrigins->setDivisor(1);
+    mDrawOrigins->bind().setData(std::vector<glm::vec3>{glm::vec3(0)});
+
+    mMultiDraw = GLAD_GL_VERSION_4_3;
+    if (mMultiDraw)
+        glGenBuffers(1, &mIndirectBuffer);
+    else
+        glow::warning() << "Multi-draw-indirect not supported, terrain meshes are drawn one by one";
+
+    mImmutableArenas = GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+    if (!mImmutableArenas)
+    {
+        glow::warning() << "Persistent buffer mapping not supported, terrain meshes are uploaded with glBufferSubData";
+        return;
+    }
+
+    // coherent: worker writes are visible to copies issued afterwards
+    auto flags = GLbitfield(GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+
+    glGenBuffers(1, &mStagingBuffer);
+    glBindBuffer(GL_COPY_READ_BUFFER, mStagingBuffer);
+    glBufferStorage(GL_COPY_READ_BUFFER, stagingBytes, nullptr, flags);
+    mStagingMemory = static_cast<uint8_t*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, stagingBytes, flags));
+
+    if (!mStagingMemory)
+        glow::error() << "Unable to map the terrain staging buffer, terrain meshes are uploaded with glBufferSubData";
+}
+
+int64_t TerrainBuffers::stage(std::vector<TerrainMeshData>& meshes)
+{
+    if (!mStagingMemory)
+        return -1; // not supported
+
+    size_t bytes = 0;
+    for (auto const& m : meshes)
+        bytes += m.vertexPositions.size() * sizeof(uint32_t) + m.vertexData.size() * sizeof(TerrainVertex);
+    bytes = (bytes + 15) / 16 * 16;
+    if (bytes == 0)
+        return -1; // nothing to stage
+
+    // allocate a block in the ring
+    size_t offset;
+    {
+        std::lock_guard<std::mutex> lock(mMutexStaging);
+
+        if (mStagingBlocks.empty())
+            mStagingHead = 0;
+
+        auto tail = mStagingBlocks.empty() ? stagingBytes : mStagingBlocks.front().offset;
+        if (mStagingBlocks.empty() || mStagingHead > tail)
+        {
+            // free: [head, end) and [0, tail)
+            if (mStagingHead + bytes <= stagingBytes)
+                offset = mStagingHead;
+            else if (bytes < tail)
+                offset = 0; // wrap around
+            else
+                return -1; // full
+        }
+        else if (mStagingHead < tail && mStagingHead + bytes < tail)
+            offset = mStagingHead; // free: [head, tail)
+        else
+            return -1; // full
+
+        mStagingBlocks.push_back({offset, bytes, -1});
+        mStagingHead = offset + bytes;
+    }
+
+    // write vertices (positions, then data) and drop the CPU copies
+    auto pos = offset;
+    for (auto& m : meshes)
+    {
+        m.stagingOffset = int64_t(pos);
+
+        auto positionBytes = m.vertexPositions.size() * sizeof(uint32_t);
+        auto dataBytes = m.vertexData.size() * sizeof(TerrainVertex);
+        if (positionBytes > 0)
+            std::memcpy(mStagingMemory + pos, m.vertexPositions.data(), positionBytes);
+        if (dataBytes > 0)
+            std::memcpy(mStagingMemory + pos + positionBytes, m.vertexData.data(), dataBytes);
+        pos += positionBytes + dataBytes;
+
+        std::vector<uint32_t>().swap(m.vertexPositions);
+        std::vector<TerrainVertex>().swap(m.vertexData);
+    }
+
+    return int64_t(offset);
+}
+
+SharedTerrainArenaRange TerrainBuffers::allocate(int quads)
+{
+    assert(0 < quads && quads <= arenaQuads);
+
+    for (auto const& arena : mArenas)
+    {
+        auto first = arena->allocate(quads);
+        if (first >= 0)
+            return std::make_shared<TerrainArenaRange>(arena, first, quads);
+    }
+
+    // all arenas are full
+    mArenas.push_back(std::make_shared<TerrainArena>(arenaQuads, mImmutableArenas, mDrawOrigins));
+    auto first = mArenas.back()->allocate(quads);
+    return std::make_shared<TerrainArenaRange>(mArenas.back(), first, quads);
+}
+
+void TerrainBuffers::upload(TerrainArenaRange const& range, int dstQuad, TerrainMeshData const& data, int srcQuad, int count)
+{
+    if (count <= 0)
+        return;
+
+    assert(dstQuad + count <= range.quadCount);
+
+    auto const& arena = *range.arena;
+    auto dst = size_t(range.firstQuad + dstQuad) * 16;
+    auto bytes = size_t(count) * 16;
+
+    if (data.stagingOffset >= 0)
+    {
+        // GPU-side copy from the staging ring
+        auto src = size_t(data.stagingOffset) + size_t(srcQuad) * 16;
+        auto dataOffset = size_t(data.quadCount()) * 16; // vertex data follows the positions
+
+        glBindBuffer(GL_COPY_READ_BUFFER, mStagingBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.abPositions->getObjectName());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src, dst, bytes);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.abData->getObjectName());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src + dataOffset, dst, bytes);
+    }
+    else
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.abPositions->getObjectName());
+        glBufferSubData(GL_COPY_WRITE_BUFFER, dst, bytes, &data.vertexPositions[srcQuad * 4]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, arena.abData->getObjectName());
+        glBufferSubData(GL_COPY_WRITE_BUFFER, dst, bytes, &data.vertexData[srcQuad * 4]);
+    }
+
+    mUploadedBytes += 2 * bytes;
+}
+
+void TerrainBuffers::clear(TerrainArenaRange const& range, int dstQuad, int count)
+{
+    if (count <= 0)
+        return;
+
+    assert(dstQuad + count <= range.quadCount);
+
+    auto const& arena = *range.arena;
+    auto dst = size_t(range.firstQuad + dstQuad) * 16;
+    auto bytes = size_t(count) * 16;
+
+    for (auto const& ab : {arena.abPositions, arena.abData})
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ab->getObjectName());
+        if (GLAD_GL_VERSION_4_3)
+            glClearBufferSubData(GL_COPY_WRITE_BUFFER, GL_R32UI, dst, bytes, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        else
+        {
+            std::vector<uint8_t> zeros(bytes, 0);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, dst, bytes, zeros.data());
+        }
+    }
+}
+
+void TerrainBuffers::release(int64_t stagingBlock)
+{
+    if (stagingBlock < 0)
+        return; // not staged
+
+    std::lock_guard<std::mutex> lock(mMutexStaging);
+    for (auto& b : mStagingBlocks)
+        if (b.offset == size_t(stagingBlock) && b.releasedFrame < 0)
+        {
+            b.releasedFrame = mFrame;
+            mReleasedThisFrame = true;
+            return;
+        }
+
+    assert(0 && "unknown staging block");
+}
+
+void TerrainBuffers::update()
+{
+    GLOW_ACTION();
+
+    mLastFrameUploadedBytes = mUploadedBytes;
+    mUploadedBytes = 0;
+
+    if (!mStagingMemory)
+        return;
+
+    // copies of this frame read the released blocks
+    if (mReleasedThisFrame)
+        mFences.push_back({mFrame, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)});
+    mReleasedThisFrame = false;
+
+    // poll finished frames (non-blocking)
+    while (!mFences.empty())
+    {
+        auto status = glClientWaitSync(mFences.front().fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+
+        mFinishedFrame = mFences.front().frame;
+        glDeleteSync(mFences.front().fence);
+        mFences.pop_front();
+    }
+
+    // re-use released blocks in ring order
+    {
+        std::lock_guard<std::mutex> lock(mMutexStaging);
+        while (!mStagingBlocks.empty() && mStagingBlocks.front().releasedFrame >= 0
+               && mStagingBlocks.front().releasedFrame <= mFinishedFrame)
+            mStagingBlocks.pop_front();
+    }
+
+    ++mFrame;
+}
+
+void TerrainBuffers::setDraws(std::vector<DrawCommand> const& commands, std::vector<glm::vec3> const& origins)
+{
+    assert(mMultiDraw && "multi-draw-indirect not supported");
+
+    if (commands.empty())
+        return;
+
+    // re-specified per pass (orphans the storage of the previous pass)
+    mDrawOrigins->bind().setData(origins, GL_STREAM_DRAW);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawCommand), commands.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void TerrainBuffers::multiDraw(int first, int count)
+{
+    assert(mMultiDraw && "multi-draw-indirect not supported");
+
+    if (count <= 0)
+        return;
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, reinterpret_cast<void const*>(first * sizeof(DrawCommand)), count, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <glow/common/shared.hh>
+#include <glow/fwd.hh>
+#include <glow/gl.hh>
+
+#include "TerrainMesh.hh"
+
+GLOW_SHARED(class, TerrainArena);
+GLOW_SHARED(struct, TerrainArenaRange);
+
+/**
+ * @brief A large vertex buffer pair (packed positions + vertex data) that terrain meshes are sub-allocated from
+ *
+ * Ranges are allocated in quads (4 vertices) and drawn with a base vertex.
+ * The VAOs also source the per-draw chunk origin (see TerrainBuffers::setDraws).
+ * Arenas are only written by GL commands, so ranges can be re-used right away
+ * (the GL orders these writes after earlier draws).
+ */
+class TerrainArena
+{
+public:
+    /// capacity in quads
+    const int quadCapacity;
+
+    /// vertex buffers (immutable storage if supported)
+    glow::SharedArrayBuffer abPositions;
+    glow::SharedArrayBuffer abData;
+
+    /// configured geometry (with the shared quad index buffer and the per-draw chunk origins)
+    glow::SharedVertexArray vaoFull;
+    glow::SharedVertexArray vaoPosOnly;
+
+private:
+    /// free ranges, first quad -> quad count (guarded by mMutex)
+    std::mutex mMutex;
+    std::map<int, int> mFreeRanges;
+
+public:
+    /// creates the GL buffers (main thread)
+    TerrainArena(int quadCapacity, bool immutable, glow::SharedArrayBuffer const& abDrawOrigins);
+
+    /// first-fit allocation of `quads` consecutive quads
+    /// returns the first quad or -1 if no free range is large enough
+    int allocate(int quads);
+    /// returns a range (thread-safe, ranges can be released by any thread)
+    void free(int firstQuad, int quads);
+};
+
+/// A range of quads in an arena, returned to the arena when the last reference is dropped
+struct TerrainArenaRange
+{
+    SharedTerrainArena const arena;
+    int const firstQuad;
+    int const quadCount;
+
+    /// first vertex of this range
+    int baseVertex() const { return firstQuad * 4; }
+
+    TerrainArenaRange(SharedTerrainArena arena, int firstQuad, int quadCount)
+      : arena(std::move(arena)), firstQuad(firstQuad), quadCount(quadCount)
+    {
+    }
+    ~TerrainArenaRange() { arena->free(firstQuad, quadCount); }
+
+    TerrainArenaRange(TerrainArenaRange const&) = delete;
+    TerrainArenaRange& operator=(TerrainArenaRange const&) = delete;
+};
+
+/**
+ * @brief Streaming upload path for terrain meshes
+ *
+ * Worker threads write finished meshes into a persistently mapped staging ring (see stage).
+ * The main thread copies them into sub-allocated arena buffers on the GPU (see upload),
+ * so mesh uploads need no CPU copies and no buffer reallocations.
+ *
+ * Staging memory is released after the copies were issued and re-used once their fence has passed.
+ * Without GL 4.4 (ARB_buffer_storage) or when the ring is full, meshes stay in CPU memory
+ * and are uploaded with glBufferSubData.
+ *
+ * Drawing: all mesh ranges of a render pass are uploaded as one indirect command buffer (see setDraws),
+ * each material bucket is then a single glMultiDrawElementsIndirect per arena (see multiDraw).
+ * Command i reads its chunk origin from instance attribute i (via its base instance).
+ */
+class TerrainBuffers
+{
+public:
+    /// size of the staging ring in bytes
+    static const size_t stagingBytes = 32 << 20;
+    /// capacity of a single arena in quads (16 bytes per quad and buffer)
+    static const int arenaQuads = 1 << 20;
+
+private:
+    /// staging ring (persistently mapped, null if not supported)
+    GLuint mStagingBuffer = 0;
+    uint8_t* mStagingMemory = nullptr;
+
+    /// allocations in the ring, in allocation order (guarded by mMutexStaging)
+    struct StagingBlock
+    {
+        size_t offset;
+        size_t size;
+        int releasedFrame; ///< -1 while in use
+    };
+    std::mutex mMutexStaging;
+    std::deque<StagingBlock> mStagingBlocks;
+    size_t mStagingHead = 0;
+
+    /// fences of frames that released staging memory (main thread only)
+    struct FrameFence
+    {
+        int frame;
+        GLsync fence;
+    };
+    std::deque<FrameFence> mFences;
+    bool mReleasedThisFrame = false;
+    int mFrame = 0;
+    int mFinishedFrame = -1; ///< last frame whose copies are done
+
+    /// arenas (main thread only)
+    std::vector<SharedTerrainArena> mArenas;
+    bool mImmutableArenas = false;
+
+    /// indirect draws (GL 4.3)
+    bool mMultiDraw = false;
+    GLuint mIndirectBuffer = 0;
+    /// per-draw chunk origins ("aChunkOrigin", divisor 1)
+    /// (a single zero origin without multi-draw, meshes then use the uChunkOrigin uniform)
+    glow::SharedArrayBuffer mDrawOrigins;
+
+    /// bytes uploaded since the last call to update
+    size_t mUploadedBytes = 0;
+    size_t mLastFrameUploadedBytes = 0;
+
+public:
+    TerrainBuffers() = default;
+    ~TerrainBuffers();
+
+    TerrainBuffers(TerrainBuffers const&) = delete;
+    TerrainBuffers& operator=(TerrainBuffers const&) = delete;
+
+    /// creates the staging ring (main thread, requires a GL context)
+    void init();
+
+    /// true iff meshes are staged in persistently mapped memory
+    bool isPersistent() const { return mStagingMemory != nullptr; }
+
+    /// number of bytes uploaded in the last frame
+    size_t uploadedBytes() const { return mLastFrameUploadedBytes; }
+
+    /// true iff meshes can be drawn with multi-draw-indirect (see setDraws)
+    bool supportsMultiDraw() const { return mMultiDraw; }
+
+public: // worker threads
+    /// copies the vertex data of all meshes into one block of the staging ring
+    /// (thread-safe, staged meshes release their CPU vectors, see TerrainMeshData::stagingOffset)
+    /// returns the block offset for release or -1 if nothing was staged (ring full or not supported)
+    int64_t stage(std::vector<TerrainMeshData>& meshes);
+
+public: // main thread
+    /// allocates a range of quads in an arena (creates a new arena if all are full)
+    SharedTerrainArenaRange allocate(int quads);
+
+    /// copies `count` quads starting at `srcQuad` of a mesh to quad `dstQuad` of a range
+    void upload(TerrainArenaRange const& range, int dstQuad, TerrainMeshData const& data, int srcQuad, int count);
+    /// makes `count` quads starting at `dstQuad` degenerate (all vertices zero)
+    void clear(TerrainArenaRange const& range, int dstQuad, int count);
+
+    /// releases a staging block after its meshes were uploaded (or dropped)
+    void release(int64_t stagingBlock);
+
+    /// call once per frame after all uploads: fences released staging memory and re-uses finished blocks
+    void update();
+
+public: // drawing (main thread, requires supportsMultiDraw)
+    /// layout of glMultiDrawElementsIndirect
+    struct DrawCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance; ///< index of the chunk origin
+    };
+
+    /// uploads the draw commands and chunk origins of a render pass
+    void setDraws(std::vector<DrawCommand> const& commands, std::vector<glm::vec3> const& origins);
+    /// issues `count` uploaded commands starting at `first` with the currently bound arena VAO
+    void multiDraw(int first, int count);
+};
@@ -1,3 +1,29 @@
 #include "TerrainMesh.hh"
 
+#include <cstdint>
+#include <vector>
 
+#include <glow/objects/ElementArrayBuffer.hh>
+
+glow::SharedElementArrayBuffer const& TerrainMesh::quadIndices()
+{
+    static glow::SharedElementArrayBuffer eab;
+
+    if (!eab)
+    {
+        static_assert(maxQuads * 4 <= 65536, "quad indices must fit into 16 bit");
+
+        std::vector<uint16_t> indices;
+        indices.reserve(maxQuads * 6);
+        for (auto q = 0; q < maxQuads; ++q)
+        {
+            auto i = uint16_t(q * 4);
+            for (auto o : {0, 1, 2, 0, 2, 3})
+                indices.push_back(uint16_t(i + o));
+        }
+
+        eab = glow::ElementArrayBuffer::create(indices);
+    }
+
+    return eab;
+}
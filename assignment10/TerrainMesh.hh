@@ -1,36 +1,79 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
+#include <glow/common/shared.hh>
 #include <glow/fwd.hh>
 
 #include <glm/glm.hpp>
 
+#include "Constants.hh"
 #include "Material.hh"
 #include "Vertices.hh"
 
-/// A terrain mesh for a (chunk, material, direction) combination
-struct TerrainMesh
-{
-    /// The material used for this mesh
-    SharedRenderMaterial mat = nullptr;
+GLOW_SHARED(struct, TerrainArenaRange);
 
-    /// Face Direction of this mesh
-    glm::ivec3 dir;
+/// A set of chunk sections (SECTION_SIZE^3 blocks each)
+/// section (sx, sy, sz) is bit (sz * SECTIONS_PER_SIDE + sy) * SECTIONS_PER_SIDE + sx
+using SectionMask = uint64_t;
+static_assert(SECTION_COUNT == 64, "one bit per section");
 
-    /// Bounding box
-    glm::vec3 aabbMin;
-    glm::vec3 aabbMax;
+static const SectionMask allSections = ~SectionMask(0);
+
+/// section index of a chunk-local block position
+inline int sectionOf(glm::ivec3 relPos)
+{
+    auto s = relPos / SECTION_SIZE;
+    return (s.z * SECTIONS_PER_SIDE + s.y) * SECTIONS_PER_SIDE + s.x;
+}
 
-    /// configured geometry
-    glow::SharedVertexArray vaoFull;
-    glow::SharedVertexArray vaoPosOnly;
+/// chunk-local position of the first block of a section
+inline glm::ivec3 sectionOrigin(int section)
+{
+    return glm::ivec3(section % SECTIONS_PER_SIDE, section / SECTIONS_PER_SIDE % SECTIONS_PER_SIDE, section / (SECTIONS_PER_SIDE * SECTIONS_PER_SIDE))
+           * SECTION_SIZE;
+}
 
-    /// vertex data
-    glow::SharedArrayBuffer abPositions;
-    glow::SharedArrayBuffer abData;
+/// all sections containing chunk-local blocks in [lo, hi] (inclusive, clamped to the chunk)
+inline SectionMask sectionsIn(glm::ivec3 lo, glm::ivec3 hi)
+{
+    auto s0 = glm::max(lo, glm::ivec3(0)) / SECTION_SIZE;
+    auto s1 = glm::min(hi, glm::ivec3(CHUNK_SIZE - 1)) / SECTION_SIZE;
+
+    SectionMask sections = 0;
+    for (auto z = s0.z; z <= s1.z; ++z)
+        for (auto y = s0.y; y <= s1.y; ++y)
+            for (auto x = s0.x; x <= s1.x; ++x)
+                sections |= SectionMask(1) << ((z * SECTIONS_PER_SIDE + y) * SECTIONS_PER_SIDE + x);
+    return sections;
+}
+
+/// chunk-local block range [lo, hi) covering a non-empty set of sections
+inline void sectionBounds(SectionMask sections, glm::ivec3& lo, glm::ivec3& hi)
+{
+    lo = glm::ivec3(CHUNK_SIZE);
+    hi = glm::ivec3(0);
+    for (auto s = 0; s < SECTION_COUNT; ++s)
+        if ((sections >> s) & 1)
+        {
+            lo = glm::min(lo, sectionOrigin(s));
+            hi = glm::max(hi, sectionOrigin(s) + SECTION_SIZE);
+        }
+}
+
+/// Parameters of a mesh job
+struct MeshRequest
+{
+    bool greedy = false;
+    int lod = 0;
 
-    /// vegetation
-    glow::SharedVertexArray vaoPlants;
-    glow::SharedArrayBuffer abPlants;
+    /// sections to re-mesh (all sections for a complete mesh)
+    SectionMask sections = allSections;
+
+    /// if true, greedy quads stay within their section and the meshes keep spare capacity per section
+    /// (required for partial updates, see Chunk::notifyMeshData)
+    bool editable = false;
 };
 
 /// A plant "seed"
@@ -52,6 +95,54 @@ struct Plant
     }
 };
 
+/// A terrain mesh for a (chunk, material, direction) combination
+/// Faces are stored as 4 vertices each and drawn with the shared quad index buffer
+/// Vertices live in a range of a shared arena buffer (see TerrainBuffers), laid out per section,
+/// so single sections can be rewritten in place (unused quads of a section are degenerate, see Chunk::notifyMeshData)
+struct TerrainMesh
+{
+    /// maximum number of quads per mesh
+    /// (a single material and direction never has more than CHUNK_SIZE^3 / 2 faces)
+    static const int maxQuads = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE / 2;
+
+    /// shared index buffer for all terrain meshes: 0,1,2, 0,2,3 per quad (maxQuads quads)
+    /// (created on first use, must be called from the main thread)
+    static glow::SharedElementArrayBuffer const& quadIndices();
+
+    /// The material used for this mesh
+    SharedRenderMaterial mat = nullptr;
+
+    /// Face Direction of this mesh
+    glm::ivec3 dir;
+
+    /// Bounding box
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+
+    /// vertex data, drawn with the arena's vertex arrays and the range's base vertex
+    /// (positions are packed relative to the chunk origin)
+    SharedTerrainArenaRange vertices;
+
+    /// number of indices to draw (6 per quad)
+    int indexCount = 0;
+
+    /// layout of the vertex range (in quads)
+    /// section s occupies [sectionOffset[s], sectionOffset[s + 1]), its first sectionCount[s] quads are used
+    std::vector<int> sectionOffset;
+    std::vector<int> sectionCount;
+
+    /// vegetation (only created for meshes with plants)
+    glow::SharedVertexArray vaoPlants;
+    glow::SharedArrayBuffer abPlants;
+
+    /// uploaded plants and their sections (kept for partial updates)
+    std::vector<Plant> plants;
+    std::vector<uint8_t> plantSections;
+
+    /// number of bytes uploaded to the GPU buffers
+    size_t gpuBytes = 0;
+};
+
 struct TerrainMeshData
 {
     /// The material used for this mesh
@@ -65,9 +156,22 @@ struct TerrainMeshData
     glm::vec3 aabbMax;
 
     /// Vertices
-    std::vector<glm::vec3> vertexPositions;
+    /// (positions are chunk-local, see TerrainVertex::packPosition)
+    std::vector<uint32_t> vertexPositions;
     std::vector<TerrainVertex> vertexData;
 
+    /// quads are sorted by section, the quads of section s are [sectionStart[s], sectionStart[s + 1])
+    /// (SECTION_COUNT + 1 entries, meshes with lod > 0 have all quads in section 0)
+    std::vector<int> sectionStart;
+
     /// Vegetation
     std::vector<Plant> plants;
+    std::vector<uint8_t> plantSections;
+
+    /// offset of the vertices in the staging ring, -1 if they are in the vectors above
+    /// (staged vertices: quadCount() * 4 positions followed by quadCount() * 4 TerrainVertex, see TerrainBuffers::stage)
+    int64_t stagingOffset = -1;
+
+    /// number of quads (vertices might be staged)
+    int quadCount() const { return sectionStart.empty() ? 0 : sectionStart.back(); }
 };
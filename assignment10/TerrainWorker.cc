@@ -1,6 +1,6 @@
 #include "TerrainWorker.hh"
 
-#include <chrono>
+#include <algorithm>
 
 #include <glm/ext.hpp>
 
@@ -10,107 +10,259 @@
 #include "MeshGenerator.hh"
 #include "World.hh"
 
-TerrainWorker::TerrainWorker(World* world) : mWorld(world)
+namespace
 {
-    // launch thread here (after member init)
-    mWorkerThread = std::thread(
-        [](TerrainWorker* w) {
-            w->run(); // execute thread
-        },
-        this);
+/// heap ordering: most important (smallest priority) job on top
+struct JobOrder
+{
+    template <class JobT>
+    bool operator()(JobT const& a, JobT const& b) const
+    {
+        return a.priority > b.priority;
+    }
+};
+}
+
+TerrainWorker::TerrainWorker(World* world, int threadCount) : mWorld(world)
+{
+    if (threadCount <= 0)
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+    for (auto i = 0; i < threadCount; ++i)
+        mQueues.emplace_back(new Queue);
+
+    // launch threads here (after member init)
+    for (auto i = 0; i < threadCount; ++i)
+        mThreads.push_back(std::thread(
+            [](TerrainWorker* w, int idx) {
+                w->run(idx); // execute thread
+            },
+            this, i));
 }
 
 void TerrainWorker::stop()
 {
-    mShouldStop = true;
-    mWorkerThread.join();
+    {
+        std::lock_guard<std::mutex> lock(mMutexWake);
+        mShouldStop = true;
+    }
+    mJobsAvailable.notify_all();
+
+    for (auto& t : mThreads)
+        t.join();
+    mThreads.clear();
+
+    // drop remaining jobs
+    for (auto& q : mQueues)
+        q->jobs.clear();
+    mPendingJobs = 0;
 }
 
 void TerrainWorker::update()
 {
-    if (mJobsGenFinished.empty() && mJobsMeshFinished.empty())
-        return; // early out
-
     mMutexFinished.lock();
 
     // process generation jobs
-    for (auto c : mJobsGenFinished)
-        mWorld->notifyChunkGenerated(c.chunk);
+    for (auto& c : mJobsGenFinished)
+        mWorld->notifyChunkGenerated(c.chunk, std::move(c.blocks), c.loaded);
     mJobsGenFinished.clear();
 
-    // process mesh jobs
-    for (auto c : mJobsMeshFinished)
-        mWorld->notifyChunkMeshed(c.chunk, c.data);
+    // queue mesh jobs for upload
+    for (auto& c : mJobsMeshFinished)
+        mMeshUploadBacklog.push_back(std::move(c));
     mJobsMeshFinished.clear();
 
     mMutexFinished.unlock();
+
+    // process mesh jobs within the upload budget
+    // (at least one per frame, so large meshes cannot stall)
+    auto& buffers = mWorld->meshBuffers;
+    auto budget = size_t(std::max(0, mWorld->meshUploadBudgetKB)) * 1024;
+    size_t uploaded = 0;
+    while (!mMeshUploadBacklog.empty() && (uploaded == 0 || uploaded < budget))
+    {
+        auto const& c = mMeshUploadBacklog.front();
+        for (auto const& m : c.data)
+            uploaded += size_t(m.quadCount()) * 4 * (sizeof(uint32_t) + sizeof(TerrainVertex));
+
+        mWorld->notifyChunkMeshed(c.chunk, c.data, c.version, c.request);
+        buffers.release(c.staging);
+        mMeshUploadBacklog.pop_front();
+    }
+
+    // recycle staging memory of finished uploads
+    buffers.update();
+}
+
+void TerrainWorker::setView(glm::vec3 position, std::shared_ptr<FrustumCuller const> frustum)
+{
+    std::lock_guard<std::mutex> lock(mMutexView);
+
+    // re-scoring is linear in the queue size, small view changes keep the priorities
+    if (mView.epoch > 0 && !mView.frustum == !frustum)
+    {
+        auto moved = distance(position, mView.position) > 2.0f;
+        auto turned = frustum && dot(frustum->forward(), mView.frustum->forward()) < 0.995f; // ~6 degrees
+        if (!moved && !turned)
+            return;
+    }
+
+    mView.position = position;
+    mView.frustum = std::move(frustum);
+    mView.epoch++;
 }
 
 void TerrainWorker::enqueueGen(SharedChunk chunk)
 {
-    mMutexNew.lock();
-    mJobsGen.push({chunk});
-    mMutexNew.unlock();
+    Job job;
+    job.type = JobType::Generate;
+    job.chunk = chunk;
+    job.version = 0;
+    enqueue(std::move(job));
 }
 
-void TerrainWorker::enqueueMesh(SharedChunk chunk, std::vector<Block> blocks)
+void TerrainWorker::enqueueMesh(SharedChunk chunk)
 {
-    mMutexNew.lock();
-    mJobsMesh.push({chunk, std::move(blocks), chunk->getMeshVersion()});
-    mMutexNew.unlock();
+    Job job;
+    job.type = JobType::Mesh;
+    job.chunk = chunk;
+    job.version = 0;
+    enqueue(std::move(job));
 }
 
-void TerrainWorker::run()
+void TerrainWorker::enqueue(Job job)
 {
+    View view;
+    {
+        std::lock_guard<std::mutex> lock(mMutexView);
+        view = mView;
+    }
+
+    auto& q = *mQueues[mNextQueue];
+    mNextQueue = (mNextQueue + 1) % mQueues.size();
+
+    job.priority = priorityOf(*job.chunk, view);
+
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.jobs.push_back(std::move(job));
+        std::push_heap(q.jobs.begin(), q.jobs.end(), JobOrder());
+    }
+
+    // wake one idle thread
+    {
+        std::lock_guard<std::mutex> lock(mMutexWake);
+        ++mPendingJobs;
+    }
+    mJobsAvailable.notify_one();
+}
+
+float TerrainWorker::priorityOf(Chunk const& chunk, View const& view)
+{
+    auto amin = glm::vec3(chunk.chunkPos);
+    auto amax = amin + float(CHUNK_SIZE);
+    auto dis = distance(clamp(view.position, amin, amax), view.position);
+
+    // chunks outside the view come after all visible ones in the vicinity
+    if (view.frustum && !view.frustum->isAabbVisible(amin, amax))
+        dis = dis * 4.0f + 4.0f * CHUNK_SIZE;
+
+    return dis;
+}
+
+bool TerrainWorker::tryPop(Queue& q, View const& view, Job& job)
+{
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.jobs.empty())
+        return false;
+
+    // re-prioritize if the view changed
+    if (q.viewEpoch != view.epoch)
+    {
+        for (auto& j : q.jobs)
+            j.priority = priorityOf(*j.chunk, view);
+        std::make_heap(q.jobs.begin(), q.jobs.end(), JobOrder());
+        q.viewEpoch = view.epoch;
+    }
+
+    std::pop_heap(q.jobs.begin(), q.jobs.end(), JobOrder());
+    job = std::move(q.jobs.back());
+    q.jobs.pop_back();
+    return true;
+}
+
+void TerrainWorker::run(int threadIdx)
+{
+    auto queueCount = (int)mQueues.size();
+
+    View view;
     while (!mShouldStop)
     {
-        auto doneWork = false;
+        // current view
+        {
+            std::lock_guard<std::mutex> lock(mMutexView);
+            if (view.epoch != mView.epoch)
+                view = mView;
+        }
+
+        // own queue first, then steal from the others
+        Job job;
+        auto hasJob = false;
+        for (auto i = 0; i < queueCount && !hasJob; ++i)
+            hasJob = tryPop(*mQueues[(threadIdx + i) % queueCount], view, job);
 
-        // generate
-        if (!mJobsGen.empty())
+        // block until new work is available
+        if (!hasJob)
         {
-            // get a job
-            mMutexNew.lock();
-            auto job = std::move(mJobsGen.front());
-            mJobsGen.pop();
-            mMutexNew.unlock();
+            std::unique_lock<std::mutex> lock(mMutexWake);
+            mJobsAvailable.wait(lock, [this] { return mShouldStop || mPendingJobs > 0; });
+            continue;
+        }
 
-            // process job
-            mWorld->generate(*job.chunk);
-            doneWork = true;
+        --mPendingJobs;
+
+        switch (job.type)
+        {
+        case JobType::Generate:
+        {
+            // process job (load if saved, generate otherwise)
+            BlockStorage blocks;
+            auto loaded = mWorld->mRegions.load(job.chunk->chunkPos, blocks);
+            if (!loaded)
+                blocks = mWorld->generate(job.chunk->chunkPos);
 
             // finish job
             mMutexFinished.lock();
-            mJobsGenFinished.push_back({job.chunk});
+            mJobsGenFinished.push_back({job.chunk, std::move(blocks), loaded});
             mMutexFinished.unlock();
         }
+        break;
 
-        // mesh
-        if (!mJobsMesh.empty())
+        case JobType::Mesh:
         {
-            mMutexNew.lock();
-            auto job = std::move(mJobsMesh.front());
-            mJobsMesh.pop();
-            mMutexNew.unlock();
-
-            // only if current mesh version
-            if (job.chunk->getMeshVersion() == job.version)
-            {
-                // process job
-                auto meshes = generateMesh(job.blocks, job.chunk->chunkPos, *mWorld);
-                doneWork = true;
-
-                // finish job
-                mMutexFinished.lock();
-                mJobsMeshFinished.push_back({ job.chunk, std::move(meshes) });
-                mMutexFinished.unlock();
-            }
-        }
+            // take the pending request
+            // (later triggers enqueue a new job)
+            MeshRequest request;
+            auto neighbors = job.chunk->takeMeshRequest(job.version, request);
 
-        // sleep if no work done
-        if (!doneWork)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (!neighbors[13])
+                break; // cancelled
+
+            // process job
+            // (partial requests only copy and mesh the dirty sections)
+            auto blocks = World::snapshotNeighborhood(neighbors, request.sections);
+            neighbors = {}; // do not keep neighbors alive longer than necessary
+            auto meshes = generateMesh(blocks, job.chunk->chunkPos, *mWorld, request.greedy, request.lod, request.sections, request.editable);
+
+            // write vertex data directly to GPU-visible memory (if supported and not full)
+            auto staging = mWorld->meshBuffers.stage(meshes);
+
+            // finish job
+            mMutexFinished.lock();
+            mJobsMeshFinished.push_back({job.chunk, std::move(meshes), job.version, request, staging});
+            mMutexFinished.unlock();
+        }
+        break;
         }
     }
 }
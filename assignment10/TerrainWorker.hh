@@ -1,78 +1,154 @@
 #pragma once
 
-#include <queue>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include <glow/common/shared.hh>
 
 #include "Block.hh"
+#include "BlockStorage.hh"
+#include "FrustumCuller.hh"
 #include "TerrainMesh.hh"
 
 class World;
 GLOW_SHARED(class, Chunk);
 
 /**
- * @brief Separate thread for generating and creating chunks
+ * @brief Pool of worker threads for generating and meshing chunks
+ *
+ * Every thread owns a job queue (a heap ordered by priority).
+ * New jobs are distributed round-robin, idle threads steal from the others.
+ * Priorities depend on the distance to the camera and frustum visibility
+ * and are re-evaluated lazily whenever the view changes (see setView).
+ *
+ * Idle threads block on a condition variable until a job is enqueued or the pool is stopped.
  */
 class TerrainWorker
 {
 private:
-    struct GenJob
+    enum class JobType
     {
-        SharedChunk chunk;
+        Generate,
+        Mesh
     };
-    struct GenJobFin
+
+    struct Job
     {
+        JobType type;
         SharedChunk chunk;
+
+        // mesh jobs only (set when the job starts)
+        int version;
+
+        /// smaller is more important
+        float priority = 0;
     };
 
-    struct MeshJob
+    struct GenJobFin
     {
         SharedChunk chunk;
-        std::vector<Block> blocks;
-        int version;
+        BlockStorage blocks;
+        bool loaded; ///< true iff loaded from a region file
     };
     struct MeshJobFin
     {
         SharedChunk chunk;
         std::vector<TerrainMeshData> data;
+        int version;
+        MeshRequest request;
+        int64_t staging; ///< staging block of the vertex data (see TerrainBuffers::stage)
+    };
+
+    /// view used for prioritization
+    struct View
+    {
+        glm::vec3 position;
+        std::shared_ptr<FrustumCuller const> frustum; ///< might be null
+        int epoch = 0;
+    };
+
+    /// per-thread job queue
+    struct Queue
+    {
+        std::mutex mutex;
+        std::vector<Job> jobs; ///< heap, most important first
+        int viewEpoch = 0;     ///< view epoch of the priorities
     };
 
 private:
     /// true iff the worker should stop
-    volatile bool mShouldStop = false;
+    std::atomic<bool> mShouldStop{false};
+
+    // wakeup
+    // (mPendingJobs is only incremented while holding mMutexWake, so no wakeup gets lost)
+    std::mutex mMutexWake;
+    std::condition_variable mJobsAvailable;
+    std::atomic<int> mPendingJobs{0};
+
+    /// worker threads
+    std::vector<std::thread> mThreads;
 
-    /// separate worker thread
-    std::thread mWorkerThread;
+    /// one queue per thread
+    std::vector<std::unique_ptr<Queue>> mQueues;
+
+    /// next queue for round-robin distribution (main thread only)
+    size_t mNextQueue = 0;
 
     /// backref to the world
     World* mWorld;
 
-    // queues
-    std::mutex mMutexNew;
+    // view
+    std::mutex mMutexView;
+    View mView;
+
+    // results
     std::mutex mMutexFinished;
 
-    std::queue<GenJob> mJobsGen;
     std::vector<GenJobFin> mJobsGenFinished;
-
-    std::queue<MeshJob> mJobsMesh;
     std::vector<MeshJobFin> mJobsMeshFinished;
 
+    /// finished mesh jobs that exceeded the upload budget (main thread only)
+    std::deque<MeshJobFin> mMeshUploadBacklog;
+
 public:
-    TerrainWorker(World* world);
+    /// creates a pool with `threadCount` threads (0 means one less than the number of cores)
+    TerrainWorker(World* world, int threadCount = 0);
 
     /// stops this worker
+    /// (wakes all threads, waits until their current job is finished, drops remaining jobs)
     void stop();
 
     /// processes all finished jobs
+    /// (mesh results are applied within the upload budget, see World::meshUploadBudgetKB)
     void update();
 
+    /// sets the view used for job prioritization
+    /// (queues are only re-prioritized if the camera moved or turned noticeably)
+    void setView(glm::vec3 position, std::shared_ptr<FrustumCuller const> frustum);
+
+    /// number of worker threads
+    int threadCount() const { return (int)mThreads.size(); }
+
     // enqueue a new job
     void enqueueGen(SharedChunk chunk);
-    void enqueueMesh(SharedChunk chunk, std::vector<Block> blocks);
+    /// the chunk must not have an active mesh job (see World::triggerMeshUpdate)
+    void enqueueMesh(SharedChunk chunk);
 
 private:
-    /// thread executio
-    void run();
+    /// thread execution
+    void run(int threadIdx);
+
+    /// adds a job to the next queue
+    void enqueue(Job job);
+
+    /// tries to get the most important job from a queue
+    bool tryPop(Queue& queue, View const& view, Job& job);
+
+    /// computes the priority of a chunk
+    static float priorityOf(Chunk const& chunk, View const& view);
 };
@@ -1,16 +1,25 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 #include <glm/glm.hpp>
 
 #include <glow/objects/ArrayBufferAttribute.hh>
 
-/// Position is stored separately
+/// Position is stored separately (packed, see packPosition)
 struct TerrainVertex
 {
     int flags;
 
+    /// packs a chunk-local vertex position (0..CHUNK_SIZE per axis) into 3 x 6 bits
+    /// the chunk origin is added in the shader (uChunkOrigin)
+    static uint32_t packPosition(glm::ivec3 localPos)
+    {
+        return uint32_t(localPos.x) | uint32_t(localPos.y) << 6 | uint32_t(localPos.z) << 12;
+    }
+    static glm::ivec3 unpackPosition(uint32_t p) { return {int(p & 63u), int((p >> 6) & 63u), int((p >> 12) & 63u)}; }
+
     static std::vector<glow::ArrayBufferAttribute> attributes()
     {
         return {
@@ -12,18 +12,22 @@
 
 #include <glm/ext.hpp>
 
-#include <cstdlib>
+#include <algorithm>
+#include <cassert>
 
 #include "helper/Noise.hh"
 
 #include "Chunk.hh"
 #include "Material.hh"
 
-World::World() : mWorker(this) {}
+World::World() : mRegions("world"), mWorker(this) {}
 
 World::~World()
 {
     mWorker.stop();
+
+    // persist edits
+    saveChunks();
 }
 
 void World::init()
@@ -33,6 +37,9 @@ void World::init()
 
     // configure world gen
     mNoiseGen.SetNoiseType(FastNoise::SimplexFractal);
+
+    // set up mesh upload
+    meshBuffers.init();
 }
 
 void World::setUpMaterials()
@@ -101,33 +108,100 @@ void World::setUpMaterials()
     addTranslucentMat("water", all(waterRM));
 }
 
-void World::triggerMeshUpdate(SharedChunk chunk)
+void World::triggerMeshUpdate(SharedChunk chunk, SectionMask sections)
 {
     if (!chunk->isGenerated())
         return; // not generated -> no mesh
 
     GLOW_ACTION();
 
-    // build blocks
+    // uniform chunks without visible faces need no mesh job
+    // (unless a job is active, its result would replace the empty mesh)
+    if (!hasVisibleFaces(*chunk) && !chunk->hasMeshJob())
+    {
+        chunk->mDisplayedMeshVersion = ++chunk->mMeshVersion;
+        chunk->mMeshLod = chunk->mDesiredLod;
+        chunk->mMeshesEditable = chunk->mIsEdited && chunk->mMeshLod == 0;
+
+        // render job caches must drop the old meshes (their arena ranges are freed)
+        if (!chunk->queryMeshes().empty())
+            notifyMeshesChanged(chunk->chunkPos);
+        chunk->notifyMeshData({});
+        return;
+    }
+
+    MeshRequest request;
+    request.greedy = greedyMeshing;
+    request.lod = chunk->mDesiredLod;
+    request.editable = chunk->mIsEdited && request.lod == 0;
+    request.sections = sections;
+
+    // partial updates need editable full-resolution meshes
+    // (the first edit of a chunk rebuilds it completely)
+    if (!request.editable || !chunk->mMeshesEditable)
+        request.sections = allSections;
+
+    // collect neighborhood (the snapshot is taken lazily when the job starts)
+    std::array<std::weak_ptr<Chunk>, 27> neighbors;
+    for (auto dz : {-1, 0, 1})
+        for (auto dy : {-1, 0, 1})
+            for (auto dx : {-1, 0, 1})
+            {
+                auto it = chunks.find(chunk->chunkPos + CHUNK_SIZE * glm::ivec3(dx, dy, dz));
+                if (it != chunks.end())
+                    neighbors[(dz + 1) * 9 + (dy + 1) * 3 + dx + 1] = it->second;
+            }
+
+    // update pending request or enqueue a new one
+    if (chunk->requestMesh(neighbors, request))
+        mWorker.enqueueMesh(chunk);
+}
+
+std::vector<Block> World::snapshotNeighborhood(std::array<SharedChunk, 27> const& neighbors, SectionMask sections)
+{
+    auto const& chunk = neighbors[13];
+
     auto cs = CHUNK_SIZE + 2;
     std::vector<Block> blocks(cs * cs * cs, Block::invalid());
-    auto bmin = chunk->chunkPos - 1;
-    auto bmax = chunk->chunkPos + CHUNK_SIZE + 1;
+
+    glm::ivec3 lo, hi;
+    sectionBounds(sections, lo, hi);
+    auto bmin = chunk->chunkPos + lo - 1;
+    auto bmax = chunk->chunkPos + hi + 1;
     for (auto dz : {-1, 0, 1})
         for (auto dy : {-1, 0, 1})
             for (auto dx : {-1, 0, 1})
             {
-                auto cp = chunk->chunkPos + CHUNK_SIZE * glm::ivec3(dx, dy, dz);
-                auto c = queryChunk(cp);
+                auto const& c = neighbors[(dz + 1) * 9 + (dy + 1) * 3 + dx + 1];
                 if (!c)
                     continue;
 
+                std::lock_guard<std::mutex> lock(c->mBlocksMutex);
+
                 // copy blocks
                 auto min = clamp(c->chunkPos, bmin, bmax) - c->chunkPos;
                 auto max = clamp(c->chunkPos + CHUNK_SIZE, bmin, bmax) - c->chunkPos;
+                if (any(greaterThanEqual(min, max)))
+                    continue; // outside of the sections
 
                 auto xCount = max.x - min.x;
 
+                // uniform neighbors are filled directly
+                if (c->isUniform())
+                {
+                    auto b = c->uniformBlock();
+                    if (b.isInvalid())
+                        continue; // already initialized to invalid
+
+                    for (auto z = min.z; z < max.z; ++z)
+                        for (auto y = min.y; y < max.y; ++y)
+                        {
+                            auto tidx = ((z + dz * CHUNK_SIZE + 1) * cs + y + dy * CHUNK_SIZE + 1) * cs + min.x + dx * CHUNK_SIZE + 1;
+                            std::fill_n(blocks.begin() + tidx, xCount, b);
+                        }
+                    continue;
+                }
+
                 for (auto z = min.z; z < max.z; ++z)
                     for (auto y = min.y; y < max.y; ++y)
                     {
@@ -136,15 +210,36 @@ void World::triggerMeshUpdate(SharedChunk chunk)
                         auto tminx = min.x + dx * CHUNK_SIZE + 1;
 
                         // copy line
-                        memcpy(&blocks[(tz * cs + ty) * cs + tminx], &c->block({min.x, y, z}), xCount * sizeof(Block));
+                        c->copyBlocks({min.x, y, z}, xCount, &blocks[(tz * cs + ty) * cs + tminx]);
                     }
             }
 
-    // bump mesh version
-    chunk->mMeshVersion++;
+    return blocks;
+}
+
+bool World::hasVisibleFaces(const Chunk& chunk) const
+{
+    if (!chunk.isUniform())
+        return true; // needs the mesher
+
+    auto b = chunk.uniformBlock();
+    if (b.isAir() || b.isInvalid())
+        return false; // nothing to mesh
+
+    if (!b.isSolid())
+        return true; // translucent faces depend on neighbor materials
 
-    // enqueue job
-    mWorker.enqueueMesh(chunk, std::move(blocks));
+    // solid chunk: faces only towards non-solid neighbors
+    // (missing neighbors are padded with invalid blocks, which count as solid)
+    for (auto d : {glm::ivec3(1, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(0, 0, 1)})
+        for (auto s : {-1, 1})
+        {
+            auto n = queryChunk(chunk.chunkPos + s * d * CHUNK_SIZE);
+            if (n && !(n->isUniform() && n->uniformBlock().isSolid()))
+                return true;
+        }
+
+    return false;
 }
 
 void World::ensureChunkAt(glm::ivec3 p)
@@ -165,6 +260,10 @@ void World::ensureChunkAt(glm::ivec3 p)
 
 void World::notifyCameraPosition(glm::vec3 pos, float renderDistance, int maxChunksPerFrame)
 {
+    mCameraPos = pos;
+    mRenderDistance = renderDistance;
+    mWorker.setView(pos, mCameraFrustum);
+
     // spiral pattern
     for (auto dis = 0; dis < renderDistance + CHUNK_SIZE * 2; dis += CHUNK_SIZE)
         for (auto dx = -dis; dx <= dis; dx += CHUNK_SIZE)
@@ -174,24 +273,199 @@ void World::notifyCameraPosition(glm::vec3 pos, float renderDistance, int maxChu
                     auto x = (int)pos.x + dx;
                     auto z = (int)pos.z + dz;
 
-                    auto ip = glm::ivec3(x, 0, z);
+                    // seed at ground level and at camera height
+                    // only trigger one chunk, rest is done after generation
+                    for (auto y : {0, (int)glm::floor(pos.y)})
+                    {
+                        auto ip = glm::ivec3(x, y, z);
 
-                    // out of render dis
-                    auto cp = chunkPos(ip);
-                    auto inChunkPos = glm::clamp(pos, glm::vec3(cp), glm::vec3(cp + CHUNK_SIZE + 1));
-                    if (distance(inChunkPos, pos) > renderDistance)
-                        continue;
+                        // out of render dis
+                        if (distanceToChunk(chunkPos(ip), pos) > renderDistance)
+                            continue;
 
-                    // only trigger one chunk, rest is done after generation
-                    ensureChunkAt(ip);
+                        ensureChunkAt(ip);
+                    }
                 }
+
+    // unload chunks that are no longer needed
+    evictChunks();
 }
 
 void World::clearChunks()
 {
     // removes all chunks
     // due to shared_ptr's also clears all associated memory
+    saveChunks();
+    for (auto const& chunkPair : chunks)
+    {
+        // like evictChunks: render job caches drop the meshes, GL objects are freed here
+        auto c = chunkPair.second.get();
+        if (!c->mMeshes.empty())
+            notifyMeshesChanged(c->chunkPos);
+        c->mMeshes.clear();
+        c->mOcclusion.query = nullptr;
+        c->cancelMeshRequest();
+    }
     chunks.clear();
+    mLastChunk = nullptr;
+    mDirtyChunks.clear();
+
+    // invalidate all mesh changes (caches rebuild from scratch)
+    ++mMeshGeneration;
+    mMeshLogStart = mMeshGeneration;
+    mMeshLog.clear();
+}
+
+void World::evictChunks()
+{
+    ++mResidencyFrame;
+
+    auto keepDistance = mRenderDistance + evictionMargin;
+
+    std::vector<Chunk*> evicted;
+    std::vector<Chunk*> candidates; // outside render distance, but within hysteresis
+    size_t blockBytes = 0;
+    size_t meshBytes = 0;
+    for (auto const& kvp : chunks)
+    {
+        auto c = kvp.second.get();
+        auto dis = distanceToChunk(c->chunkPos, mCameraPos);
+
+        if (dis <= mRenderDistance)
+            c->mLastUsedFrame = mResidencyFrame;
+        else if (dis > keepDistance)
+        {
+            evicted.push_back(c);
+            continue;
+        }
+        else
+            candidates.push_back(c);
+
+        blockBytes += sizeof(Chunk) + c->blockMemoryBytes();
+        meshBytes += c->meshMemoryBytes();
+    }
+
+    // enforce memory budget: evict least recently used chunks
+    // (chunks within render distance are never evicted, they would be re-generated immediately)
+    auto budget = size_t(memoryBudgetMB) * 1024 * 1024;
+    if (blockBytes + meshBytes > budget)
+    {
+        std::sort(begin(candidates), end(candidates),
+                  [](Chunk const* a, Chunk const* b) { return a->mLastUsedFrame < b->mLastUsedFrame; });
+
+        for (auto c : candidates)
+        {
+            if (blockBytes + meshBytes <= budget)
+                break;
+
+            blockBytes -= sizeof(Chunk) + c->blockMemoryBytes();
+            meshBytes -= c->meshMemoryBytes();
+            evicted.push_back(c);
+        }
+
+        if (blockBytes + meshBytes > budget && !mBudgetWarningShown)
+        {
+            glow::warning() << "Chunk memory budget of " << memoryBudgetMB << " MB is too small for the render distance";
+            mBudgetWarningShown = true;
+        }
+    }
+
+    mResidentBlockBytes = blockBytes;
+    mResidentMeshBytes = meshBytes;
+
+    if (evicted.empty())
+        return;
+
+    // write back modified chunks
+    for (auto c : evicted)
+        if (c->mIsModified)
+        {
+            if (!mRegions.save(c->chunkPos, c->mBlocks))
+                glow::error() << "Unable to save chunk at " << c->chunkPos;
+            c->mIsModified = false;
+        }
+
+    // remove from pending lists
+    std::sort(begin(evicted), end(evicted));
+    auto isEvicted = [&](Chunk* c) { return std::binary_search(begin(evicted), end(evicted), c); };
+    mDirtyChunks.erase(std::remove_if(begin(mDirtyChunks), end(mDirtyChunks), isEvicted), end(mDirtyChunks));
+    mUnsavedChunks.erase(std::remove_if(begin(mUnsavedChunks), end(mUnsavedChunks), isEvicted), end(mUnsavedChunks));
+    if (isEvicted(mLastChunk))
+        mLastChunk = nullptr;
+
+    for (auto c : evicted)
+    {
+        // release GPU memory here (worker jobs might keep the chunk alive, but must not free GL objects)
+        if (!c->mMeshes.empty())
+            notifyMeshesChanged(c->chunkPos);
+        c->mMeshes.clear();
+        c->mOcclusion.query = nullptr;
+
+        c->cancelMeshRequest();
+
+        chunks.erase(c->chunkPos); // might delete c
+    }
+}
+
+float World::distanceToChunk(glm::ivec3 chunkPos, glm::vec3 pos) const
+{
+    auto inChunkPos = glm::clamp(pos, glm::vec3(chunkPos), glm::vec3(chunkPos + CHUNK_SIZE));
+    return distance(inChunkPos, pos);
+}
+
+void World::setGreedyMeshing(bool enable)
+{
+    if (greedyMeshing == enable)
+        return;
+
+    greedyMeshing = enable;
+    remeshAll();
+}
+
+void World::remeshAll()
+{
+    for (auto const& kvp : chunks)
+        triggerMeshUpdate(kvp.second);
+}
+
+void World::requestLod(SharedChunk const& chunk, int lod)
+{
+    assert(0 <= lod && lod < LOD_LEVELS);
+
+    if (chunk->mDesiredLod == lod)
+        return;
+
+    chunk->mDesiredLod = lod;
+    triggerMeshUpdate(chunk);
+}
+
+void World::markModified(Chunk& chunk)
+{
+    if (!chunk.mIsModified)
+        mUnsavedChunks.push_back(&chunk);
+
+    chunk.mIsModified = true;
+}
+
+void World::saveChunks(double maxSeconds)
+{
+    glow::timing::SystemTimer timer;
+    while (!mUnsavedChunks.empty())
+    {
+        if (maxSeconds >= 0 && timer.getTimeDiffInSecondsD() > maxSeconds)
+            break;
+
+        auto c = mUnsavedChunks.back();
+        mUnsavedChunks.pop_back();
+
+        {
+            std::lock_guard<std::mutex> lock(c->mBlocksMutex);
+            c->mBlocks.compact();
+        }
+        if (!mRegions.save(c->chunkPos, c->mBlocks))
+            glow::error() << "Unable to save chunk at " << c->chunkPos;
+        c->mIsModified = false;
+    }
 }
 
 void World::notifyDirtyChunk(Chunk* chunk)
@@ -200,11 +474,22 @@ void World::notifyDirtyChunk(Chunk* chunk)
     mDirtyChunks.push_back(chunk);
 }
 
-void World::notifyChunkGenerated(SharedChunk c)
+void World::notifyChunkGenerated(SharedChunk c, BlockStorage blocks, bool loaded)
 {
+    if (chunks.get(c->chunkPos) != c.get())
+        return; // chunk was removed in the meantime
+
     // chunk is now generated
+    {
+        std::lock_guard<std::mutex> lock(c->mBlocksMutex);
+        c->mBlocks = std::move(blocks);
+    }
     c->mIsGenerated = true;
 
+    // only edited chunks are saved unless generated ones are cached explicitly
+    if (!loaded && cacheGeneratedChunks)
+        markModified(*c);
+
     // mark neighboring chunks as dirty
     for (auto dz = -1; dz <= 1; ++dz)
         for (auto dy = -1; dy <= 1; ++dy)
@@ -218,46 +503,93 @@ void World::notifyChunkGenerated(SharedChunk c)
     // do CPU update
     c->update();
 
+    // vertical generation is bounded by the render distance
+    // (continued by notifyCameraPosition when the camera comes closer)
+    auto up = c->chunkPos + glm::ivec3(0, CHUNK_SIZE, 0);
+    auto down = c->chunkPos - glm::ivec3(0, CHUNK_SIZE, 0);
+
     // trigger gen up
-    if (!c->isFullyAir())
-        ensureChunkAt(c->chunkPos + glm::ivec3(0, CHUNK_SIZE, 0));
+    if (!c->isFullyAir() && distanceToChunk(up, mCameraPos) <= mRenderDistance)
+        ensureChunkAt(up);
 
     // trigger gen down
-    if (!c->isFullySolid())
-        ensureChunkAt(c->chunkPos - glm::ivec3(0, CHUNK_SIZE, 0));
+    if (!c->isFullySolid() && distanceToChunk(down, mCameraPos) <= mRenderDistance)
+        ensureChunkAt(down);
+}
 
-    // fail safe
-    if (c->chunkPos.y < -500 || c->chunkPos.y > 500)
-    {
-        glow::info() << "DEEP OR HIGH CHUNK - memory not optimized for this";
-        glow::info() << " at " << c->chunkPos;
-        glow::info() << " is fully air? " << c->isFullyAir();
-        glow::info() << " is fully solid? " << c->isFullySolid();
-        for (auto m : c->queryMaterials())
-            glow::info() << " - contains " << (m ? m->name : "<air>");
-        glow::info() << " aborting before memory issues arise.";
-        exit(0);
-    }
+void World::notifyMeshesChanged(glm::ivec3 chunkPos)
+{
+    ++mMeshGeneration;
+    mMeshLog.push_back(chunkPos);
+}
+
+bool World::meshChangesSince(int generation, std::vector<glm::ivec3>& chunkPositions) const
+{
+    if (generation < mMeshLogStart)
+        return false; // log already cleared
+
+    chunkPositions.insert(chunkPositions.end(), mMeshLog.begin() + (generation - mMeshLogStart), mMeshLog.end());
+    return true;
+}
+
+void World::trimMeshLog(int generation)
+{
+    generation = glm::clamp(generation, mMeshLogStart, mMeshGeneration);
+    generation = glm::max(generation, mMeshGeneration - maxMeshLogLength);
+
+    mMeshLog.erase(mMeshLog.begin(), mMeshLog.begin() + (generation - mMeshLogStart));
+    mMeshLogStart = generation;
 }
 
-void World::notifyChunkMeshed(SharedChunk chunk, std::vector<TerrainMeshData> const& data)
+void World::notifyChunkMeshed(SharedChunk chunk, std::vector<TerrainMeshData> const& data, int version, MeshRequest const& request)
 {
-    chunk->notifyMeshData(data);
+    if (chunks.get(chunk->chunkPos) != chunk.get())
+        return; // chunk was evicted in the meantime
+
+    if (version > chunk->mDisplayedMeshVersion) // otherwise: newer mesh already displayed
+    {
+        if (request.sections == allSections)
+        {
+            chunk->mDisplayedMeshVersion = version;
+            chunk->mMeshLod = request.lod;
+            chunk->mMeshesEditable = request.editable;
+            chunk->notifyMeshData(data);
+            notifyMeshesChanged(chunk->chunkPos);
+        }
+        else if (chunk->mMeshLod == request.lod && chunk->notifyMeshData(data, request.sections))
+        {
+            chunk->mDisplayedMeshVersion = version;
+            notifyMeshesChanged(chunk->chunkPos);
+        }
+        else
+            triggerMeshUpdate(chunk); // out of reserved capacity
+    }
+
+    // jobs of a chunk run one after another
+    if (chunk->finishMeshJob())
+        mWorker.enqueueMesh(chunk);
 }
 
 void World::update(float elapsedSeconds)
 {
+    // lazily write back modified chunks (at most 2ms per frame)
+    saveChunks(2 / 1000.0);
+
     // update dirty chunks
     glow::timing::SystemTimer timer;
     for (auto i = (int)mDirtyChunks.size() - 1; i >= 0; --i)
     {
         auto c = mDirtyChunks[i];
+        auto sections = c->mDirtySections;
 
         // perform CPU update
         c->update(); // CAUTION: if update might trigger new dirty chunks, this should be guarded
+        c->mDirtySections = 0;
 
         // queue mesh update
-        triggerMeshUpdate(chunks[c->chunkPos]);
+        // (chunks can be listed twice, the first entry takes all sections)
+        if (sections)
+            triggerMeshUpdate(chunks[c->chunkPos], sections);
 
         // remove from list
         mDirtyChunks.erase(mDirtyChunks.begin() + i);
@@ -346,7 +678,7 @@ float getRandFloat01Wang(glm::ivec3 worldPos)
     return float(wang_hash(seed)) / std::numeric_limits<uint32_t>::max();
 }
 }
-void World::generate(Chunk& c)
+BlockStorage World::generate(glm::ivec3 chunkPos) const
 {
     GLOW_ACTION("[WORKER] - generate chunk");
 
@@ -367,6 +699,10 @@ void World::generate(Chunk& c)
     auto matLightFountain = getMaterialFromName("lightfountain");
 
 
+    // generate into a flat array, compressed at the end
+    std::vector<Block> blocks(BlockStorage::blockCount);
+    auto block = [&blocks](glm::ivec3 rp) -> Block& { return blocks[Chunk::blockIndex(rp)]; };
+
     // TODO: cooler
 
     for (auto z = 0; z < CHUNK_SIZE; ++z)
@@ -374,7 +710,7 @@ void World::generate(Chunk& c)
             for (auto x = 0; x < CHUNK_SIZE; ++x)
             {
                 auto rp = glm::ivec3(x, y, z);
-                auto ip = c.chunkPos + rp;
+                auto ip = chunkPos + rp;
                 auto p = glm::vec3(ip);
 
                 // terrain options
@@ -407,7 +743,7 @@ void World::generate(Chunk& c)
                             // Avoid grass below the surface
                             if (y > 0)
                             {
-                                Block& below = c.block(glm::ivec3(x, y - 1, z));
+                                Block& below = block(glm::ivec3(x, y - 1, z));
                                 if (below.mat == matGrass->index)
                                     below.mat = matDirt->index;
                             }
@@ -430,7 +766,7 @@ void World::generate(Chunk& c)
                             // Avoid snow and gras below surface (except snow below snow)
                             if (y > 0)
                             {
-                                Block& below = c.block(glm::ivec3(x, y - 1, z));
+                                Block& below = block(glm::ivec3(x, y - 1, z));
 
                                 if (mat != matSnow && (below.mat == matSnowRock->index || below.mat == matSnow->index))
                                 {
@@ -455,7 +791,7 @@ void World::generate(Chunk& c)
                             mat = matCrystal;
                         else
                         {
-                            bool belowIsRock = c.block(glm::ivec3(x, y - 1, z)).mat == matRock->index;
+                            bool belowIsRock = y > 0 && block(glm::ivec3(x, y - 1, z)).mat == matRock->index;
                             // other minerals lie mainly below hills but only on rock material
                             if (d > 8 && belowIsRock)
                             {
@@ -482,7 +818,7 @@ void World::generate(Chunk& c)
                         mat = matWater;
                     else if (p.y <= 20 && y > 0)
                     {
-                        Block const& below = c.block(glm::ivec3(x, y - 1, z));
+                        Block const& below = block(glm::ivec3(x, y - 1, z));
                         if (!below.isInvalid() && below.isSolid())
                         {
                             const float spawnChance = 1 / 4000.0;
@@ -493,21 +829,25 @@ void World::generate(Chunk& c)
                 }
 
                 // assign material
-                c.block(rp).mat = mat ? mat->index : 0;
+                block(rp).mat = mat ? mat->index : 0;
             }
 
-    // we changed everything!
-    c.markDirty();
+    // chunk is marked dirty when the result is committed (notifyChunkGenerated)
+    BlockStorage storage;
+    storage.assign(blocks.data());
+    return storage;
 }
 
 Chunk* World::queryChunk(glm::ivec3 p) const
 {
-    auto it = chunks.find(chunkPos(p));
-
-    if (it == chunks.end())
-        return nullptr;
+    auto cp = chunkPos(p);
+    if (mLastChunk && mLastChunk->chunkPos == cp)
+        return mLastChunk;
 
-    return it->second.get();
+    auto c = chunks.get(cp);
+    if (c)
+        mLastChunk = c;
+    return c;
 }
 
 Chunk& World::queryChunkAlloc(glm::ivec3 p)
@@ -518,40 +858,38 @@ Chunk& World::queryChunkAlloc(glm::ivec3 p)
     return *c;
 }
 
-const Block& World::queryBlock(glm::ivec3 p) const
+Block World::queryBlock(glm::ivec3 p) const
 {
-    static Block invalid = Block::invalid();
-
-    auto cp = chunkPos(p);
-    auto it = chunks.find(cp);
+    auto c = queryChunk(p);
 
-    if (it == chunks.end())
-        return invalid;
+    if (!c)
+        return Block::invalid();
 
-    return it->second->block(p - cp);
+    return c->block(p - c->chunkPos);
 }
 
-Block& World::queryBlockMutable(glm::ivec3 p)
+void World::setBlock(glm::ivec3 p, Block b)
 {
     auto& c = queryChunkAlloc(p);
-    return c.block(p - c.chunkPos);
+    c.setBlock(p - c.chunkPos, b);
+
+    // edits of non-generated chunks are overwritten anyway
+    if (c.isGenerated())
+        markModified(c);
 }
 
 void World::markDirty(glm::ivec3 p, int rad)
 {
-    while (rad >= 0)
-    {
-        for (auto dx : {-1, 1})
-            for (auto dy : {-1, 1})
-                for (auto dz : {-1, 1})
-                {
-                    auto np = p + glm::ivec3(dx, dy, dz) * rad;
-                    auto& c = queryChunkAlloc(np);
-                    c.markDirty();
-                }
-
-        rad -= CHUNK_SIZE;
-    }
+    auto c0 = chunkPos(p - rad);
+    auto c1 = chunkPos(p + rad);
+    for (auto z = c0.z; z <= c1.z; z += CHUNK_SIZE)
+        for (auto y = c0.y; y <= c1.y; y += CHUNK_SIZE)
+            for (auto x = c0.x; x <= c1.x; x += CHUNK_SIZE)
+            {
+                auto& c = queryChunkAlloc({x, y, z});
+                c.mIsEdited = true;
+                c.markDirty(sectionsIn(p - rad - c.chunkPos, p + rad - c.chunkPos));
+            }
 }
 
 Material const* World::getMaterialFromIndex(int matIdx) const
@@ -635,6 +973,40 @@ RayHit World::rayCast(glm::vec3 pos, glm::vec3 dir, float maxRange) const
             hit.block = Block::air();
         else
             hit.block = chunk->block(ipos - chunk->chunkPos);
+
+        // skip uniform air chunks in one step
+        if (chunk && chunk->isUniform() && (hit.block.isAir() || hit.block.isInvalid()))
+        {
+            auto exitPos = glm::vec3(chunk->chunkPos + nidir * CHUNK_SIZE);
+            auto exitT = (exitPos - pos) / dir + 0.001f;
+
+            if (exitT.x <= exitT.y && exitT.x <= exitT.z)
+            {
+                hit.hitNormal = {1, 0, 0};
+                t = exitT.x;
+            }
+            else if (exitT.y <= exitT.z)
+            {
+                hit.hitNormal = {0, 1, 0};
+                t = exitT.y;
+            }
+            else
+            {
+                hit.hitNormal = {0, 0, 1};
+                t = exitT.z;
+            }
+
+            // stop at max range (stays inside the air chunk)
+            if (t > maxRange)
+                break;
+
+            pos += t * dir;
+            ipos = glm::ivec3(glm::floor(pos));
+            maxRange -= t;
+
+            chunk = queryChunk(ipos);
+            hit.block = chunk ? chunk->block(ipos - chunk->chunkPos) : Block::air();
+        }
     }
 
     // fill in hit
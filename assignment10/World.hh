@@ -1,14 +1,16 @@
 #pragma once
 
+#include <array>
 #include <map>
-#include <unordered_map>
 #include <vector>
 
 #include <glm/glm.hpp>
-#include <glm/gtx/hash.hpp>
 
 #include "Chunk.hh"
+#include "ChunkMap.hh"
 #include "Material.hh"
+#include "RegionFile.hh"
+#include "TerrainBuffers.hh"
 #include "helper/Noise.hh"
 
 #include "Constants.hh"
@@ -30,23 +32,77 @@ class World
 {
 public: // public members
     /// list of active chunks
-    std::unordered_map<glm::ivec3, SharedChunk> chunks;
+    ChunkMap chunks;
 
     /// list of opaque materials
     std::vector<Material> materialsOpaque;
     /// list of translucent materials
     std::vector<Material> materialsTranslucent;
 
+    /// chunks are evicted once they are this far outside the render distance
+    /// (hysteresis, avoids re-generation when moving back and forth)
+    float evictionMargin = 2 * CHUNK_SIZE;
+
+    /// if true, chunks are meshed with greedy meshing (see setGreedyMeshing)
+    bool greedyMeshing = false;
+
+    /// memory budget for resident chunks (blocks + meshes)
+    /// least recently used chunks outside the render distance are evicted first
+    int memoryBudgetMB = 1024;
+
+    /// GPU storage and streaming uploads of terrain meshes
+    /// (declared before the worker, which stages meshes into it)
+    TerrainBuffers meshBuffers;
+
+    /// max. bytes of mesh data uploaded per frame (at least one mesh job is applied per frame)
+    int meshUploadBudgetKB = 8 * 1024;
+
+    /// if true, newly generated chunks are saved to the region files as well
+    /// (loading is cheaper than generating, but costs disk space; edited chunks are always saved)
+    bool cacheGeneratedChunks = false;
+
 private: // private members
     /// Noise generator
     FastNoise mNoiseGen;
 
+    /// chunk of the last queryChunk/queryBlock (main thread only)
+    /// (most queries hit the same chunk as the previous one)
+    mutable Chunk* mLastChunk = nullptr;
+
+    /// last camera position and render distance (see notifyCameraPosition)
+    glm::vec3 mCameraPos;
+    float mRenderDistance = 0.0f;
+    std::shared_ptr<FrustumCuller const> mCameraFrustum;
+
+    /// incremented per eviction pass (LRU "time")
+    int mResidencyFrame = 0;
+
+    /// resident memory as of the last eviction pass
+    size_t mResidentBlockBytes = 0;
+    size_t mResidentMeshBytes = 0;
+
+    bool mBudgetWarningShown = false;
+
     /// List of chunks that require updating
     std::vector<Chunk*> mDirtyChunks;
 
+    /// mesh change log (see meshChangesSince)
+    /// entry i is the change to generation mMeshLogStart + i + 1, trimmed by the renderer (see trimMeshLog)
+    static const int maxMeshLogLength = 1 << 16;
+    int mMeshGeneration = 0;
+    int mMeshLogStart = 0;
+    std::vector<glm::ivec3> mMeshLog;
+
     /// list of RenderMaterials
     std::vector<SharedRenderMaterial> renderMaterials;
 
+    /// region files for persistent chunks
+    /// (declared before the worker, which loads from it)
+    RegionStore mRegions;
+
+    /// List of chunks that have to be written to the region files
+    std::vector<Chunk*> mUnsavedChunks;
+
     /// worker thread
     TerrainWorker mWorker;
 
@@ -61,19 +117,63 @@ public:
     void ensureChunkAt(glm::ivec3 p);
 
     /// ensures that all required chunks around the camera are generated
+    /// and evicts chunks that are too far away
     void notifyCameraPosition(glm::vec3 pos, float renderDistance, int maxChunksPerFrame = 1);
 
+    /// sets the camera frustum used to prioritize generation and meshing
+    /// (call before notifyCameraPosition)
+    void notifyCameraFrustum(std::shared_ptr<FrustumCuller const> frustum) { mCameraFrustum = std::move(frustum); }
+
+    /// number of bytes used by resident chunks on the CPU (including block storage)
+    size_t residentBlockBytes() const { return mResidentBlockBytes; }
+    /// number of bytes used by resident chunk meshes on the GPU
+    size_t residentMeshBytes() const { return mResidentMeshBytes; }
+
+    /// incremented whenever the meshes of a chunk change (or chunks with meshes are removed)
+    int meshGeneration() const { return mMeshGeneration; }
+    /// appends the positions of all chunks whose meshes changed since `generation` (may contain duplicates)
+    /// returns false if the log does not reach back that far (already trimmed)
+    bool meshChangesSince(int generation, std::vector<glm::ivec3>& chunkPositions) const;
+    /// drops the logged changes up to `generation` (once all consumers have seen them)
+    /// (the log keeps at most maxMeshLogLength changes, consumers that fall behind further have to rebuild)
+    void trimMeshLog(int generation);
+
     /// deletes all chunks
+    /// (modified chunks are saved first)
     void clearChunks();
 
+    /// enables or disables greedy meshing (re-meshes all chunks on change)
+    void setGreedyMeshing(bool enable);
+
+    /// triggers a mesh update for all generated chunks
+    void remeshAll();
+
+    /// sets the level of detail a chunk should be meshed with (0 .. LOD_LEVELS - 1)
+    /// (re-meshes the chunk on change, the old mesh is displayed until the new one arrives)
+    void requestLod(SharedChunk const& chunk, int lod);
+
+    /// Performs procedural generation of a chunk
+    /// (thread-safe, result is committed in notifyChunkGenerated)
+    BlockStorage generate(glm::ivec3 chunkPos) const;
+
+    /// writes modified chunks to their region files
+    /// stops after `maxSeconds` (saves all if negative)
+    void saveChunks(double maxSeconds = -1);
+
     /// adds a chunk to the update list
     /// also triggers mesh update
     void notifyDirtyChunk(Chunk* chunk);
 
-    /// notifies that a chunk was generated
-    void notifyChunkGenerated(SharedChunk chunk);
+    /// notifies that a chunk was generated or loaded
+    /// (commits the blocks to the chunk)
+    void notifyChunkGenerated(SharedChunk chunk, BlockStorage blocks, bool loaded);
+    /// records a mesh change of a chunk (see meshChangesSince)
+    void notifyMeshesChanged(glm::ivec3 chunkPos);
+
     /// notifies that a chunk mesh was updated
-    void notifyChunkMeshed(SharedChunk chunk, std::vector<TerrainMeshData> const& data);
+    /// (ignored if a newer mesh version is already displayed,
+    /// partial meshes that do not fit the displayed ones trigger a complete re-mesh)
+    void notifyChunkMeshed(SharedChunk chunk, std::vector<TerrainMeshData> const& data, int version, MeshRequest const& request);
 
     /// Update step
     void update(float elapsedSeconds);
@@ -82,8 +182,30 @@ private: // helper
     /// creates all materials
     void setUpMaterials();
 
-    /// triggers a mesh update for a given chunk
-    void triggerMeshUpdate(SharedChunk chunk);
+    /// triggers a mesh update for some sections of a given chunk
+    /// (coalesced: at most one mesh job per chunk is active,
+    /// partial updates fall back to complete ones if the displayed meshes are not editable)
+    void triggerMeshUpdate(SharedChunk chunk, SectionMask sections = allSections);
+
+    /// copies the blocks of a chunk (index 13) and its 26 neighbors (missing ones may be null)
+    /// into a padded (CHUNK_SIZE + 2)^3 array
+    /// only the given sections and a 1 block border are copied, the rest is invalid
+    /// (thread-safe, locks each chunk while copying)
+    static std::vector<Block> snapshotNeighborhood(std::array<SharedChunk, 27> const& neighbors, SectionMask sections = allSections);
+
+    /// marks a chunk for saving
+    void markModified(Chunk& chunk);
+
+    /// removes chunks outside the hysteresis radius or exceeding the memory budget
+    /// (modified chunks are saved, meshes released)
+    void evictChunks();
+
+    /// distance from a position to the bounds of a chunk
+    float distanceToChunk(glm::ivec3 chunkPos, glm::vec3 pos) const;
+
+    /// returns false if the chunk is known to have no visible faces
+    /// (only decides for uniform chunks, returns true otherwise)
+    bool hasVisibleFaces(Chunk const& chunk) const;
 
     /// Adds an opaque material, automatically searches textures
     /// CAREFUL: return value only valid until next mat is added
@@ -97,8 +219,6 @@ private: // helper
     /// Copy/extend RenderMaterials to Material
     void copyRenderMaterials(Material& mat, std::vector<SharedRenderMaterial> const& renderMats);
 
-    /// Performs procedural generation of a chunk
-    void generate(Chunk& c);
 
 public: // accessor functions
     /// for a given world space position, returns the starting position of the associated chunk
@@ -120,13 +240,14 @@ public: // accessor functions
     /// queries a block at a given position
     /// returns an INVALID block if not found
     /// (does not allocate new chunks dynamically)
-    Block const& queryBlock(glm::ivec3 p) const;
-    /// queries a block at a given position
-    /// returns a MUTABLE reference to the block
+    Block queryBlock(glm::ivec3 p) const;
+    /// sets a block at a given position
     /// allocates chunks dynamically
-    Block& queryBlockMutable(glm::ivec3 p);
+    /// (does not mark anything dirty, see markDirty)
+    void setBlock(glm::ivec3 p, Block b);
 
-    /// Marks all blocks in a given radius as dirty
+    /// Marks all blocks in a given radius as dirty (edited)
+    /// (only the affected sections are re-meshed)
     void markDirty(glm::ivec3 p, int rad);
 
     /// Returns the material of that idx